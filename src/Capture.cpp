@@ -0,0 +1,193 @@
+#include <cstring>
+
+#include "Capture.h"
+#include "Counters.h"
+
+using namespace std;
+
+const char Capture::MAGIC[8] = { 'P', 'i', 'V', 'T', 'c', 'a', 'p', '1' };
+
+Capture::Capture()
+  : Logging("Capture"),
+    _file(nullptr),
+    _timer(CTimer::Get()),
+    _last_time(0),
+    _bytes_written(0),
+    _dropped(0),
+    _active(0),
+    _fill(0),
+    _pending(0),
+    _written(0)
+{
+}
+
+Capture::~Capture()
+{
+  stop();
+}
+
+bool
+Capture::start(const char* filename)
+{
+  stop();
+
+  _file = fopen(filename, "wb");
+  if (!_file) {
+    log(LogError, "Cannot create %s", filename);
+    return false;
+  }
+  // The blocks are written as they are, without another copy
+  setvbuf(_file, nullptr, _IONBF, 0);
+
+  _last_time = _timer->GetClockTicks();
+  _bytes_written = 0;
+  _dropped = 0;
+  _pending = _written = 0;
+  // The magic goes through the buffer, so that the blocks that are
+  // written start at multiples of the block size in the file
+  memcpy(_buffers[_active], MAGIC, sizeof MAGIC);
+  _fill = sizeof MAGIC;
+
+  log(LogNotice, "Capturing to %s", filename);
+  return true;
+}
+
+void
+Capture::stop()
+{
+  if (!_file) {
+    return;
+  }
+
+  if (_pending) {
+    write(_buffers[_active ^ 1] + _written, _pending - _written);
+    _pending = 0;
+  }
+  if (_file && _fill) {
+    write(_buffers[_active], _fill);
+    _fill = 0;
+  }
+  if (_file) {
+    fclose(_file);
+    _file = nullptr;
+  }
+
+  if (_dropped) {
+    log(LogWarning, "%u records dropped", _dropped);
+  }
+  log(LogNotice, "Capture stopped, %u bytes written", (unsigned) _bytes_written);
+}
+
+void
+Capture::data(const char* data, size_t length)
+{
+  record(Data, data, length);
+}
+
+void
+Capture::keys(unsigned char modifiers, const unsigned char keys[6])
+{
+  uint8_t report[7];
+  report[0] = modifiers;
+  memcpy(report + 1, keys, 6);
+  record(Keys, report, sizeof report);
+}
+
+void
+Capture::record(RecordType type, const void* payload, size_t length)
+{
+  if (!_file) {
+    return;
+  }
+
+  const unsigned now = _timer->GetClockTicks();
+  uint8_t header[1 + 2 * MAX_NUMBER_BYTES];
+  size_t header_length = 0;
+  header[header_length++] = type;
+  header_length += encode(header + header_length, now - _last_time);
+  if (type == Data) {
+    header_length += encode(header + header_length, length);
+  }
+
+  const size_t size = header_length + length;
+  if (_fill + size > BUFFER_SIZE && !_pending) {
+    swap();
+  }
+  if (_fill + size > BUFFER_SIZE) {
+    _dropped++;
+    Counters::add(Counters::CaptureDrops);
+    return;
+  }
+
+  uint8_t* p = _buffers[_active] + _fill;
+  memcpy(p, header, header_length);
+  memcpy(p + header_length, payload, length);
+  _fill += size;
+  _last_time = now;
+}
+
+// The whole blocks of the active buffer become pending, which the other
+// one must not be.  The rest is moved to the other buffer.
+void
+Capture::swap()
+{
+  const size_t rest = _fill % BLOCK_SIZE;
+  _pending = _fill - rest;
+  _written = 0;
+  memcpy(_buffers[_active ^ 1], _buffers[_active] + _pending, rest);
+  _active ^= 1;
+  _fill = rest;
+}
+
+// Only whole blocks are written while capturing, each at a multiple of
+// the block size in the file, so that the SD card does not have to read
+// partial sectors back.
+void
+Capture::drain(unsigned budget)
+{
+  const unsigned start = _timer->GetClockTicks();
+  do {
+    if (!_file) {
+      return;
+    }
+    if (!_pending && _fill >= BLOCK_SIZE) {
+      swap();
+    }
+    if (!_pending) {
+      return;
+    }
+    const size_t length = min(BLOCK_SIZE, _pending - _written);
+    if (write(_buffers[_active ^ 1] + _written, length)) {
+      _written += length;
+      if (_written == _pending) {
+        _pending = 0;
+      }
+    }
+  } while (_timer->GetClockTicks() - start < budget);
+}
+
+// The capture ends when the file cannot be written
+bool
+Capture::write(const uint8_t* data, size_t length)
+{
+  if (fwrite(data, 1, length, _file) != length) {
+    log(LogError, "Write error, capture stopped after %u bytes", (unsigned) _bytes_written);
+    fclose(_file);
+    _file = nullptr;
+    return false;
+  }
+  _bytes_written += length;
+  return true;
+}
+
+size_t
+Capture::encode(uint8_t* p, uint32_t value)
+{
+  size_t length = 0;
+  while (value >= 0x80) {
+    p[length++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  p[length++] = value;
+  return length;
+}
@@ -0,0 +1,85 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+#include <circle/timer.h>
+
+#include "Logging.h"
+
+using namespace std;
+
+// Records a session in a file so that it can be played back by Replay:
+// the bytes received from the serial port and the keyboard reports,
+// each with the time since the previous record.  The file starts with
+// MAGIC, followed by records that start with their type and the time
+// difference in microseconds:
+//
+//   Data: type, time, length, bytes
+//   Keys: type, time, modifiers, six key codes
+//
+// Times and lengths are written in seven bit groups, least significant
+// first, with the top bit set in all but the last byte.  The keyboard
+// report is the one of the USB boot protocol.
+//
+// Records are collected in one of two buffers while the other one is
+// written to the file a block at a time when the main loop has nothing
+// else to do.  The buffers hold several seconds of input at high serial
+// speeds.  Records that find both buffers full are dropped and counted,
+// so capturing never makes the terminal wait for the SD card.
+class Capture
+  : protected Logging
+{
+public:
+  enum RecordType : uint8_t {
+    Data = 1,
+    Keys = 2
+  };
+
+  static const char MAGIC[8];
+  // Bytes needed for a 32 bit number
+  static const size_t MAX_NUMBER_BYTES = 5;
+
+  Capture();
+  ~Capture();
+
+  bool start(const char* filename);
+  // Writes everything that has been captured and closes the file
+  void stop();
+  bool active() const { return _file != nullptr; }
+
+  void data(const char* data, size_t length);
+  void keys(unsigned char modifiers, const unsigned char keys[6]);
+
+  // Writes blocks for up to budget microseconds, at least one if any
+  // is ready
+  void drain(unsigned budget);
+
+  // Bytes written to the file so far
+  size_t bytes_written() const { return _bytes_written; }
+
+private:
+  static const size_t BUFFER_SIZE = 65536;
+  static const size_t BLOCK_SIZE = 512;
+
+  FILE* _file;
+  CTimer* _timer;
+  unsigned _last_time;
+  size_t _bytes_written;
+  unsigned _dropped;
+
+  // Records are appended to the active buffer.  The other one holds
+  // pending bytes, of which the first are written already.
+  uint8_t _buffers[2][BUFFER_SIZE];
+  unsigned _active;
+  size_t _fill;
+  size_t _pending;
+  size_t _written;
+
+  void record(RecordType type, const void* payload, size_t length);
+  void swap();
+  bool write(const uint8_t* data, size_t length);
+  static size_t encode(uint8_t* p, uint32_t value);
+};
@@ -0,0 +1,24 @@
+
+#include "Counters.h"
+
+using namespace std;
+
+unsigned Counters::_values[Counters::COUNTERS];
+
+// Indexed by Counter.  The names are used in the report to the host.
+const char* const Counters::_names[Counters::COUNTERS] = {
+  "parsed",
+  "damage",
+  "cells",
+  "cells_skipped",
+  "dma",
+  "dma_wait_us",
+  "glyph_hits",
+  "glyph_misses",
+  "cursor",
+  "palette",
+  "loops",
+  "loop_us",
+  "loop_max_us",
+  "capture_drops",
+};
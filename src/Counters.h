@@ -0,0 +1,52 @@
+// -*- C++ -*-
+
+#pragma once
+
+using namespace std;
+
+// Counters of the work done by the terminal since it was started.  They
+// are shown by Ctrl+SysRq and reported to the host in response to
+// CSI ? 999 q, together with the counters of the serial port.  Values
+// are 32 bits wide and wrap around, so readers should use differences.
+class Counters
+{
+public:
+  enum Counter {
+    BytesParsed,
+    DamageCallbacks,
+    CellsRendered,
+    // Damaged cells that already showed what they should
+    CellsSkipped,
+    DMATransfers,
+    DMAWaitMicroseconds,
+    GlyphHits,
+    GlyphMisses,
+    CursorRedraws,
+    PaletteUpdates,
+    LoopIterations,
+    LoopMicroseconds,
+    // The longest main loop iteration since the last report to the host
+    LoopMaxMicroseconds,
+    // Capture records that found both buffers full
+    CaptureDrops,
+    COUNTERS
+  };
+
+  static void add(Counter counter, unsigned n = 1) { _values[counter] += n; }
+  static void
+  maximum(Counter counter, unsigned n)
+  {
+    if (n > _values[counter]) {
+      _values[counter] = n;
+    }
+  }
+
+  static void reset(Counter counter) { _values[counter] = 0; }
+
+  static unsigned get(Counter counter) { return _values[counter]; }
+  static const char* name(Counter counter) { return _names[counter]; }
+
+private:
+  static unsigned _values[COUNTERS];
+  static const char* const _names[COUNTERS];
+};
@@ -0,0 +1,495 @@
+
+#include <cstring>
+
+#include <circle/dmachannel.h>
+#include <circle/synchronize.h>
+
+#include <circle/timer.h>
+
+#ifndef PIVT_HOST
+#include <circle/bcm2835.h>
+#include <circle/machineinfo.h>
+#include <circle/memio.h>
+#endif
+
+#include "Counters.h"
+#include "DMAQueue.h"
+#include "Profile.h"
+
+using namespace std;
+
+#define TI_TDMODE               (1 << 1)
+#define TI_WAIT_RESP            (1 << 3)
+#define TI_DEST_INC             (1 << 4)
+#define TI_SRC_INC              (1 << 8)
+#define TI_BURST_LENGTH_SHIFT   12
+#define TI_NO_WIDE_BURSTS       (1 << 26)
+
+#define TRANSFER_LENGTH_YLENGTH_SHIFT 16
+#define STRIDE_DEST_SHIFT             16
+
+#ifndef PIVT_HOST
+
+#define ARM_DMACHAN_CS(chan)        (ARM_DMA_BASE + ((chan) * 0x100) + 0x00)
+#define ARM_DMACHAN_CONBLK_AD(chan) (ARM_DMA_BASE + ((chan) * 0x100) + 0x04)
+#define ARM_DMACHAN_DEBUG(chan)     (ARM_DMA_BASE + ((chan) * 0x100) + 0x20)
+#define ARM_DMA_ENABLE              (ARM_DMA_BASE + 0xFF0)
+
+#define CS_RESET                        (1U << 31)
+#define CS_WAIT_FOR_OUTSTANDING_WRITES  (1 << 28)
+#define CS_PANIC_PRIORITY_SHIFT         20
+#define CS_PRIORITY_SHIFT               16
+#define CS_ERROR                        (1 << 8)
+#define CS_INT                          (1 << 2)
+#define CS_END                          (1 << 1)
+#define CS_ACTIVE                       (1 << 0)
+
+#define DEFAULT_PRIORITY        1
+#define DEFAULT_PANIC_PRIORITY  15
+
+#define DEBUG_ERRORS            0x07
+
+#define TO_BUS_ADDRESS(p) BUS_ADDRESS(reinterpret_cast<uintptr>(p))
+
+#else
+
+#define TO_BUS_ADDRESS(p) reinterpret_cast<uintptr_t>(p)
+
+#endif
+
+DMAQueue::DMAQueue()
+  : Logging("DMAQueue"),
+    _building(0),
+    _cpu_threshold(0),
+    _fill_threshold(0),
+    _allocation(nullptr),
+    _allocation_size(0),
+    _allocation_transfers(0)
+{
+  const size_t control_blocks_size = BATCH_CONTROL_BLOCKS * sizeof(ControlBlock);
+
+  // Both batches and the fill patterns are allocated in one block that
+  // is aligned to the control block size, as required by the DMA
+  // controller.
+  _memory = new uint8_t[2 * (control_blocks_size + BATCH_STAGING_SIZE) + sizeof(u32) * 256 + sizeof(ControlBlock)];
+  uint8_t* p = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(_memory) + sizeof(ControlBlock) - 1)
+                                          & ~(sizeof(ControlBlock) - 1));
+  for (auto& batch : _batches) {
+    batch._control_blocks = reinterpret_cast<ControlBlock*>(p);
+    batch._count = 0;
+    p += control_blocks_size;
+    batch._staging = p;
+    batch._staging_used = 0;
+    p += BATCH_STAGING_SIZE;
+  }
+  u32* patterns = reinterpret_cast<u32*>(p);
+  for (unsigned int value = 0; value < 256; value++) {
+    patterns[value] = value * 0x01010101U;
+  }
+  _patterns = patterns;
+
+#ifndef PIVT_HOST
+  // The patterns are never written again
+  CleanAndInvalidateDataCacheRange(reinterpret_cast<uintptr>(_patterns), 256 * sizeof(u32));
+
+  _channel = CMachineInfo::Get()->AllocateDMAChannel(DMA_CHANNEL_NORMAL);
+
+  write32(ARM_DMA_ENABLE, read32(ARM_DMA_ENABLE) | (1 << _channel));
+  CTimer::SimpleusDelay(1000);
+
+  write32(ARM_DMACHAN_CS(_channel), CS_RESET);
+  while (read32(ARM_DMACHAN_CS(_channel)) & CS_RESET) {
+  }
+#else
+  _channel = 0;
+#endif
+}
+
+DMAQueue::~DMAQueue()
+{
+  sync();
+
+#ifndef PIVT_HOST
+  write32(ARM_DMACHAN_CS(_channel), CS_RESET);
+  CMachineInfo::Get()->FreeDMAChannel(_channel);
+#endif
+
+  delete[] _memory;
+}
+
+uint8_t*
+DMAQueue::allocate(size_t size, unsigned int transfers)
+{
+  // Allocations are kept aligned to the cache line size.
+  size = (size + sizeof(ControlBlock) - 1) & ~(sizeof(ControlBlock) - 1);
+
+  // Make sure that the transfers that use the memory end up in the
+  // same batch.  If no transfer has been queued, earlier allocations
+  // have been used by the CPU.
+  Batch* batch = &_batches[_building];
+  if (batch->_count == 0) {
+    batch->_staging_used = 0;
+  }
+  if (batch->_staging_used + size > BATCH_STAGING_SIZE
+      || batch->_count + transfers > BATCH_CONTROL_BLOCKS) {
+    wait();
+    start();
+    batch = &_batches[_building];
+  }
+
+  _allocation = batch->_staging + batch->_staging_used;
+  _allocation_size = size;
+  _allocation_transfers = transfers;
+  batch->_staging_used += size;
+  return _allocation;
+}
+
+DMAQueue::ControlBlock*
+DMAQueue::add_control_block(u32 transfer_information,
+                            const void* source,
+                            void* destination,
+                            unsigned int width,
+                            unsigned int height,
+                            int destination_stride,
+                            int source_stride)
+{
+  Counters::add(Counters::DMATransfers);
+
+  Batch* batch = &_batches[_building];
+  if (batch->_count == BATCH_CONTROL_BLOCKS) {
+    wait();
+    // Copies that are still to be queued read the last allocation, so
+    // it goes to the next batch with them.  That batch has completed,
+    // its staging memory is free.
+    uint8_t* moved = _allocation_transfers ? _batches[_building ^ 1]._staging : nullptr;
+    if (moved) {
+      memcpy(moved, _allocation, _allocation_size);
+    }
+    start();
+    batch = &_batches[_building];
+    if (moved) {
+      const uint8_t* p = static_cast<const uint8_t*>(source);
+      if (p >= _allocation && p < _allocation + _allocation_size) {
+        source = moved + (p - _allocation);
+      }
+      batch->_staging_used = _allocation_size;
+      _allocation = moved;
+    }
+  }
+
+  ControlBlock* control_block = &batch->_control_blocks[batch->_count];
+  control_block->_transfer_information = transfer_information | TI_TDMODE | TI_DEST_INC | TI_WAIT_RESP;
+  control_block->_source_address = TO_BUS_ADDRESS(source);
+  control_block->_destination_address = TO_BUS_ADDRESS(destination);
+  control_block->_transfer_length = ((height - 1) << TRANSFER_LENGTH_YLENGTH_SHIFT) | width;
+  control_block->_stride = ((destination_stride & 0xffff) << STRIDE_DEST_SHIFT) | (source_stride & 0xffff);
+  control_block->_next_control_block = 0;
+
+  if (batch->_count) {
+    batch->_control_blocks[batch->_count - 1]._next_control_block = TO_BUS_ADDRESS(control_block);
+  }
+  batch->_count++;
+
+  return control_block;
+}
+
+// Copies like the controller does: row by row, each row front to back.
+// The common glyph widths are handled with fixed size copies which the
+// compiler turns into a few word loads and stores.
+static void
+cpu_copy(uint8_t* destination,
+         const uint8_t* source,
+         unsigned int width,
+         unsigned int height,
+         int destination_stride,
+         int source_stride)
+{
+  const int destination_pitch = width + destination_stride;
+  const int source_pitch = width + source_stride;
+
+  switch (width) {
+  case 10:
+    for (; height; height--, destination += destination_pitch, source += source_pitch) {
+      memmove(destination, source, 10);
+    }
+    break;
+  case 20:
+    for (; height; height--, destination += destination_pitch, source += source_pitch) {
+      memmove(destination, source, 20);
+    }
+    break;
+  default:
+    for (; height; height--, destination += destination_pitch, source += source_pitch) {
+      if (destination > source && destination < source + width) {
+        for (unsigned int x = 0; x < width; x++) {
+          destination[x] = source[x];
+        }
+      } else {
+        memmove(destination, source, width);
+      }
+    }
+    break;
+  }
+}
+
+static void
+cpu_fill(uint8_t* destination,
+         uint8_t value,
+         unsigned int width,
+         unsigned int height,
+         int destination_stride)
+{
+  for (; height; height--, destination += width + destination_stride) {
+    memset(destination, value, width);
+  }
+}
+
+void
+DMAQueue::copy(void* destination,
+               const void* source,
+               unsigned int width,
+               unsigned int height,
+               int destination_stride,
+               int source_stride)
+{
+  if (width * height <= _cpu_threshold && idle()) {
+    PROFILE_STAGE(Blit);
+    cpu_copy(static_cast<uint8_t*>(destination), static_cast<const uint8_t*>(source),
+             width, height,
+             destination_stride, source_stride);
+  } else {
+    add_control_block(TI_SRC_INC | (2 << TI_BURST_LENGTH_SHIFT),
+                      source, destination,
+                      width, height,
+                      destination_stride, source_stride);
+  }
+
+  if (_allocation_transfers) {
+    _allocation_transfers--;
+  }
+}
+
+void
+DMAQueue::fill(void* destination,
+               uint8_t value,
+               unsigned int width,
+               unsigned int height,
+               int destination_stride)
+{
+  if (width * height <= _fill_threshold && idle()) {
+    PROFILE_STAGE(Blit);
+    cpu_fill(static_cast<uint8_t*>(destination), value, width, height, destination_stride);
+    return;
+  }
+
+  // Without TI_SRC_INC, the controller reads the same word for every
+  // write.  The patterns are not staged, so that a fill can be queued
+  // while memory that has been allocated for another transfer is being
+  // written.
+  add_control_block(TI_NO_WIDE_BURSTS,
+                    &_patterns[value], destination,
+                    width, height,
+                    destination_stride, 0);
+}
+
+void
+DMAQueue::kick()
+{
+  if (_batches[_building]._count && !busy()) {
+    start();
+  }
+}
+
+void
+DMAQueue::sync()
+{
+  wait();
+  if (_batches[_building]._count) {
+    start();
+    wait();
+  }
+}
+
+// Finds the largest transfers of a glyph row's height, in steps of
+// doubling widths up to 32 KB or the pitch, that the CPU copies from
+// staging memory and fills faster than the controller.
+// Must be called while no transfers are queued.
+void
+DMAQueue::calibrate(uint8_t* destination, unsigned int pitch)
+{
+  const unsigned int height = 20;
+  const unsigned int repeat = 64;
+  uint8_t* source = _batches[0]._staging;
+  CTimer* timer = CTimer::Get();
+
+  sync();
+  _cpu_threshold = 0;
+  for (unsigned int width = 10; width * height <= 32 * 1024 && width <= pitch; width *= 2) {
+    unsigned int begin = timer->GetClockTicks();
+    for (unsigned int i = 0; i < repeat; i++) {
+      cpu_copy(destination, source, width, height, pitch - width, 0);
+    }
+    const unsigned int cpu = timer->GetClockTicks() - begin;
+
+    begin = timer->GetClockTicks();
+    for (unsigned int i = 0; i < repeat; i++) {
+      add_control_block(TI_SRC_INC | (2 << TI_BURST_LENGTH_SHIFT),
+                        source, destination,
+                        width, height,
+                        pitch - width, 0);
+      start();
+      wait();
+    }
+    const unsigned int dma = timer->GetClockTicks() - begin;
+
+    log(LogDebug, "Copying %u bytes takes %u us with the CPU, %u us with DMA", width * height * repeat, cpu, dma);
+    if (dma < cpu) {
+      break;
+    }
+    _cpu_threshold = width * height;
+  }
+
+  _fill_threshold = 0;
+  for (unsigned int width = 10; width * height <= 32 * 1024 && width <= pitch; width *= 2) {
+    unsigned int begin = timer->GetClockTicks();
+    for (unsigned int i = 0; i < repeat; i++) {
+      cpu_fill(destination, 0, width, height, pitch - width);
+    }
+    const unsigned int cpu = timer->GetClockTicks() - begin;
+
+    begin = timer->GetClockTicks();
+    for (unsigned int i = 0; i < repeat; i++) {
+      add_control_block(TI_NO_WIDE_BURSTS,
+                        &_patterns[0], destination,
+                        width, height,
+                        pitch - width, 0);
+      start();
+      wait();
+    }
+    const unsigned int dma = timer->GetClockTicks() - begin;
+
+    log(LogDebug, "Filling %u bytes takes %u us with the CPU, %u us with DMA", width * height * repeat, cpu, dma);
+    if (dma < cpu) {
+      break;
+    }
+    _fill_threshold = width * height;
+  }
+
+  log(LogNotice, "Copies of up to %u bytes and fills of up to %u bytes are done by the CPU",
+      (unsigned) _cpu_threshold, (unsigned) _fill_threshold);
+}
+
+#ifndef PIVT_HOST
+
+bool
+DMAQueue::busy()
+{
+  return read32(ARM_DMACHAN_CS(_channel)) & CS_ACTIVE;
+}
+
+// Starts the batch that is being built.  The other batch must have
+// completed.
+void
+DMAQueue::start()
+{
+  Batch& batch = _batches[_building];
+
+  CleanAndInvalidateDataCacheRange(reinterpret_cast<uintptr>(batch._control_blocks),
+                                   batch._count * sizeof(ControlBlock));
+  CleanAndInvalidateDataCacheRange(reinterpret_cast<uintptr>(batch._staging),
+                                   batch._staging_used);
+
+  write32(ARM_DMACHAN_CONBLK_AD(_channel), TO_BUS_ADDRESS(batch._control_blocks));
+  write32(ARM_DMACHAN_CS(_channel),
+          CS_WAIT_FOR_OUTSTANDING_WRITES
+          | (DEFAULT_PANIC_PRIORITY << CS_PANIC_PRIORITY_SHIFT)
+          | (DEFAULT_PRIORITY << CS_PRIORITY_SHIFT)
+          | CS_ACTIVE);
+
+  _building ^= 1;
+  _batches[_building]._count = 0;
+  _batches[_building]._staging_used = 0;
+}
+
+void
+DMAQueue::wait()
+{
+  u32 cs = read32(ARM_DMACHAN_CS(_channel));
+  if (cs & CS_ACTIVE) {
+    CTimer* timer = CTimer::Get();
+    const unsigned start = timer->GetClockTicks();
+    while ((cs = read32(ARM_DMACHAN_CS(_channel))) & CS_ACTIVE) {
+    }
+    Counters::add(Counters::DMAWaitMicroseconds, timer->GetClockTicks() - start);
+  }
+
+  if (cs & CS_ERROR) {
+    log(LogError, "DMA error, debug register 0x%x", read32(ARM_DMACHAN_DEBUG(_channel)) & DEBUG_ERRORS);
+    write32(ARM_DMACHAN_DEBUG(_channel), DEBUG_ERRORS);
+  }
+  write32(ARM_DMACHAN_CS(_channel), CS_END | CS_INT);
+}
+
+#else
+
+// On the host, batches are executed by interpreting their control
+// blocks when they are started.
+
+bool
+DMAQueue::busy()
+{
+  return false;
+}
+
+void
+DMAQueue::start()
+{
+  PROFILE_STAGE(Blit);
+
+  Batch& batch = _batches[_building];
+
+  for (const ControlBlock* control_block = batch._control_blocks;
+       control_block;
+       control_block = reinterpret_cast<const ControlBlock*>(control_block->_next_control_block)) {
+    const int width = control_block->_transfer_length & 0xffff;
+    const unsigned height = (control_block->_transfer_length >> TRANSFER_LENGTH_YLENGTH_SHIFT) + 1;
+    const int destination_stride = static_cast<int16_t>(control_block->_stride >> STRIDE_DEST_SHIFT);
+    const int source_stride = static_cast<int16_t>(control_block->_stride & 0xffff);
+    const bool source_increment = control_block->_transfer_information & TI_SRC_INC;
+
+    uint8_t* destination = reinterpret_cast<uint8_t*>(control_block->_destination_address);
+    const uint8_t* source = reinterpret_cast<const uint8_t*>(control_block->_source_address);
+    for (unsigned y = 0; y < height; y++) {
+      if (source_increment) {
+        if (destination > source && destination < source + width) {
+          // The controller copies front to back
+          for (int x = 0; x < width; x++) {
+            destination[x] = source[x];
+          }
+        } else {
+          memmove(destination, source, width);
+        }
+        source += width + source_stride;
+      } else {
+        memset(destination, *source, width);
+      }
+      destination += width + destination_stride;
+    }
+  }
+
+  // Staged data is only valid until its batch has been executed.
+  // Spoiling it makes transfers that read it later on show up as
+  // wrong pixels.
+  memset(batch._staging, 0xa5, batch._staging_used);
+
+  _building ^= 1;
+  _batches[_building]._count = 0;
+  _batches[_building]._staging_used = 0;
+}
+
+void
+DMAQueue::wait()
+{
+}
+
+#endif
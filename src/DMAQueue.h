@@ -0,0 +1,120 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <circle/types.h>
+
+#include "Logging.h"
+
+// Queue of 2D DMA transfers that are executed as chains of BCM2835 DMA
+// control blocks.
+//
+// Transfers are collected in a batch which is started by kick()
+// without waiting for it to complete, so that the CPU can continue to
+// work while the batch is being executed.  A new batch is built while
+// the previous one runs.  Source data for transfers must be allocated
+// with allocate() and is valid until the batch that it belongs to has
+// been executed.  sync() must be called before the CPU accesses memory
+// that queued transfers write to.
+//
+// Setting up the controller costs more than copying a few hundred
+// bytes with the CPU, so small transfers are done by the CPU right
+// away if no transfers are pending.  The sizes up to which that is
+// faster, for copies and for fills, are measured by calibrate().
+class DMAQueue
+  : protected Logging
+{
+public:
+  DMAQueue();
+  ~DMAQueue();
+
+  // The memory is used by the next `transfers` copies that are queued.
+  // Earlier allocations must have been used by then.  Fills may be
+  // queued in between, and if they start the batch, the memory is
+  // moved to the next one so that it stays with the copies that use
+  // it.  allocation() returns where it is.
+  uint8_t* allocate(size_t size, unsigned int transfers = 1);
+  uint8_t* allocation() const { return _allocation; }
+
+  // Strides are added to the respective address after each row and
+  // may be negative.
+  void copy(void* destination,
+            const void* source,
+            unsigned int width,
+            unsigned int height,
+            int destination_stride = 0,
+            int source_stride = 0);
+
+  void fill(void* destination,
+            uint8_t value,
+            unsigned int width,
+            unsigned int height,
+            int destination_stride = 0);
+
+  void kick();
+  void sync();
+  bool busy();
+
+  // The transfers are timed with rows of the given pitch at destination
+  // as the target, which should be frame buffer memory, as that takes
+  // CPU stores differently than cached memory does.  A glyph row's
+  // height of these rows is overwritten.
+  void calibrate(uint8_t* destination, unsigned int pitch);
+  size_t cpu_threshold() const { return _cpu_threshold; }
+  size_t fill_threshold() const { return _fill_threshold; }
+
+private:
+#ifdef PIVT_HOST
+  using BusAddress = uintptr_t;
+#else
+  using BusAddress = u32;
+#endif
+
+  struct ControlBlock
+  {
+    u32 _transfer_information;
+    BusAddress _source_address;
+    BusAddress _destination_address;
+    u32 _transfer_length;
+    u32 _stride;
+    BusAddress _next_control_block;
+    u32 _reserved[2];
+  } __attribute__((aligned(32)));
+
+  struct Batch
+  {
+    ControlBlock* _control_blocks;
+    unsigned int _count;
+    uint8_t* _staging;
+    size_t _staging_used;
+  };
+
+  static const unsigned int BATCH_CONTROL_BLOCKS = 256;
+  static const size_t BATCH_STAGING_SIZE = 512 * 1024;
+
+  unsigned int _channel;
+  uint8_t* _memory;
+  Batch _batches[2];
+  unsigned int _building;
+  // One word of each byte value, the source of fills
+  const u32* _patterns;
+  size_t _cpu_threshold;
+  size_t _fill_threshold;
+
+  // The last allocation and the number of copies still to use it
+  uint8_t* _allocation;
+  size_t _allocation_size;
+  unsigned int _allocation_transfers;
+
+  ControlBlock* add_control_block(u32 transfer_information,
+                                  const void* source,
+                                  void* destination,
+                                  unsigned int width,
+                                  unsigned int height,
+                                  int destination_stride,
+                                  int source_stride);
+  void start();
+  void wait();
+
+  bool idle() { return _batches[_building]._count == 0 && !busy(); }
+};
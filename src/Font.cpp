@@ -0,0 +1,135 @@
+
+#include <cstring>
+
+#include "Font.h"
+
+using namespace std;
+
+static constexpr uint16_t glyph_rows[] = {
+#include "font.inc"
+};
+
+const uint16_t* const Font::_glyphs = glyph_rows;
+
+// One bit for each glyph that has no pixels set
+static constexpr auto blank_glyphs = [] {
+  struct {
+    uint32_t _bits[256 / 32];
+  } table {};
+  for (unsigned int c = 0; c < 256; c++) {
+    bool blank = true;
+    for (unsigned int y = 0; y < Font::height; y++) {
+      blank = blank && glyph_rows[c * Font::height + y] == 0;
+    }
+    table._bits[c / 32] |= blank << (c % 32);
+  }
+  return table;
+}();
+
+bool
+Font::blank(unsigned char c)
+{
+  return (blank_glyphs._bits[c / 32] >> (c % 32)) & 1;
+}
+
+// Masks with one byte set for each bit of a nibble, lowest bit in the
+// lowest byte.  The pixel order in memory thus matches the bit order in
+// font rows on little endian machines.
+static const uint32_t nibble_masks[16] = {
+  0x00000000, 0x000000ff, 0x0000ff00, 0x0000ffff,
+  0x00ff0000, 0x00ff00ff, 0x00ffff00, 0x00ffffff,
+  0xff000000, 0xff0000ff, 0xff00ff00, 0xff00ffff,
+  0xffff0000, 0xffff00ff, 0xffffff00, 0xffffffff
+};
+
+// Font rows with every pixel doubled, for double width glyphs
+static constexpr auto double_width_rows = [] {
+  struct {
+    uint32_t _rows[1 << Font::width];
+  } table {};
+  for (uint32_t row = 0; row < (1 << Font::width); row++) {
+    for (unsigned int x = 0; x < Font::width; x++) {
+      if (row & (1 << x)) {
+        table._rows[row] |= 3 << (2 * x);
+      }
+    }
+  }
+  return table;
+}();
+
+static inline void
+expand_row(uint8_t* p,
+           uint32_t row,
+           unsigned int width,
+           uint32_t foreground,
+           uint32_t background)
+{
+  for (; width >= 4; width -= 4) {
+    const uint32_t mask = nibble_masks[row & 0xf];
+    const uint32_t pixels = (foreground & mask) | (background & ~mask);
+    memcpy(p, &pixels, sizeof pixels);
+    p += 4;
+    row >>= 4;
+  }
+  // Glyphs are ten or twenty pixels wide, which leaves two
+  if (width == 2) {
+    const uint16_t mask = nibble_masks[row & 0x3];
+    const uint16_t pixels = (foreground & mask) | (background & ~mask);
+    memcpy(p, &pixels, sizeof pixels);
+    return;
+  }
+  for (; width; width--) {
+    *p++ = (row & 1) ? foreground : background;
+    row >>= 1;
+  }
+}
+
+void
+Font::mask(uint32_t* rows,
+           unsigned char c,
+           Size size,
+           bool underline)
+{
+  // Double height glyphs show each row of their half twice
+  unsigned int first_row = (size == DoubleHeightBottom) ? (height / 2) : 0;
+  unsigned int shift = (size == DoubleHeightTop || size == DoubleHeightBottom) ? 1 : 0;
+
+  for (unsigned int y = 0; y < height; y++) {
+    const unsigned int source_y = first_row + (y >> shift);
+    uint32_t font_row = (underline && source_y == height - 1) ? ((1 << width) - 1) : row(c, source_y);
+    if (size != Normal) {
+      font_row = double_width_rows._rows[font_row];
+    }
+    rows[y] = font_row;
+  }
+}
+
+void
+Font::expand(uint8_t* p,
+             unsigned int pitch,
+             const uint32_t* rows,
+             unsigned int pixels,
+             uint8_t foreground_color,
+             uint8_t background_color)
+{
+  const uint32_t foreground = foreground_color * 0x01010101U;
+  const uint32_t background = background_color * 0x01010101U;
+
+  for (unsigned int y = 0; y < height; y++) {
+    expand_row(p, rows[y], pixels, foreground, background);
+    p += pitch;
+  }
+}
+
+void
+Font::render(uint8_t* p,
+             unsigned char c,
+             Size size,
+             bool underline,
+             uint8_t foreground_color,
+             uint8_t background_color)
+{
+  uint32_t rows[height];
+  mask(rows, c, size, underline);
+  expand(p, glyph_width(size), rows, glyph_width(size), foreground_color, background_color);
+}
@@ -0,0 +1,64 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <cstdint>
+
+using namespace std;
+
+// The VT220 font.  Each row of a glyph is stored as a 16 bit word with
+// the leftmost pixel in the lowest bit.  A glyph is turned into a mask
+// of one such row per pixel row for its size, which is expanded to 8 bit
+// pixels in the colors of the cell four pixels at a time.
+class Font
+{
+public:
+  static const unsigned int width = 10;
+  static const unsigned int height = 20;
+
+  enum Size {
+    Normal,
+    DoubleWidth,
+    DoubleHeightTop,
+    DoubleHeightBottom
+  };
+
+  // Width of a glyph of the given size in pixels
+  static unsigned int
+  glyph_width(Size size)
+  {
+    return (size == Normal) ? width : (2 * width);
+  }
+
+  // Writes the mask rows of the glyph for c to rows, which holds height
+  // entries
+  static void mask(uint32_t* rows,
+                   unsigned char c,
+                   Size size,
+                   bool underline);
+
+  // Writes a glyph of the given width in pixels to p, with rows that
+  // are pitch bytes apart
+  static void expand(uint8_t* p,
+                     unsigned int pitch,
+                     const uint32_t* rows,
+                     unsigned int pixels,
+                     uint8_t foreground_color,
+                     uint8_t background_color);
+
+  // Writes the glyph for c to p, glyph_width(size) pixels per row
+  static void render(uint8_t* p,
+                     unsigned char c,
+                     Size size,
+                     bool underline,
+                     uint8_t foreground_color,
+                     uint8_t background_color);
+
+  // Whether the glyph for c has no pixels set
+  static bool blank(unsigned char c);
+
+  static uint16_t row(unsigned char c, unsigned int y) { return _glyphs[c * height + y]; }
+
+private:
+  static const uint16_t* const _glyphs;
+};
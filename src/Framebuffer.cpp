@@ -9,97 +9,172 @@
 #include <circle/timer.h>
 
 #include "Framebuffer.h"
+#include "Counters.h"
+#include "Profile.h"
+#include "Trace.h"
 
 using namespace std;
 
-uint8_t G_FONT_GLYPHS[] = {
-#include "font.inc"
-};
-
 using dma_buffer = unsigned int __attribute__((aligned(0x100)))[16];
 
 dma_buffer mem_buff_dma;
 
-const unsigned GLYPH_CACHE_SIZE = 1024;
+// glyph_key() uses the character code, the underline attribute and two
+// bits for double width and height.
+const unsigned GLYPH_KEYS = 1 << 11;
+
+// Height of the virtual frame buffer that the screen is panned over, in
+// screen heights.  The screen contents are copied back to the other end
+// of the virtual frame buffer after (SCROLL_SCREENS - 1) screen heights
+// worth of line feeds.
+const unsigned SCROLL_SCREENS = 4;
+
+// The palette holds the colors of the xterm palette after the terminal
+// colors: the dark ANSI colors except for black, the 6x6x6 color cube
+// and the gray ramp.  The other ANSI colors are part of the cube or the
+// ramp already.
+const unsigned CUBE_COLORS = 7;
+const unsigned GRAY_COLORS = CUBE_COLORS + 6 * 6 * 6;
+const unsigned XTERM_COLORS = GRAY_COLORS + 24;
+
+static const uint32_t ansi_colors[CUBE_COLORS] = {
+  0x800000, 0x008000, 0x808000, 0x000080, 0x800080, 0x008080, 0xc0c0c0
+};
+static const uint8_t cube_levels[6] = { 0x00, 0x5f, 0x87, 0xaf, 0xdf, 0xff };
+
+static inline uint32_t
+xterm_color(unsigned i)
+{
+  if (i < CUBE_COLORS) {
+    return ansi_colors[i];
+  }
+  if (i < GRAY_COLORS) {
+    i -= CUBE_COLORS;
+    return (cube_levels[i / 36] << 16) | (cube_levels[i / 6 % 6] << 8) | cube_levels[i % 6];
+  }
+  return (8 + 10 * (i - GRAY_COLORS)) * 0x010101;
+}
+
+// The xterm color closest to each color with five bits per component,
+// computed when the first frame buffer is set up.  The closest colors of
+// the cube and the gray ramp are found by rounding the components and
+// their average, the ANSI colors are compared one by one.
+static uint8_t closest_colors[1 << 15];
 
-class ColorBuffer {
-public:
-  ColorBuffer(GFX_COL color) {
-    memset(_buf, color, sizeof(_buf));
+static void
+find_closest_colors()
+{
+  auto distance = [](uint32_t color, int red, int green, int blue) {
+    const int dr = static_cast<int>(color >> 16) - red;
+    const int dg = static_cast<int>((color >> 8) & 0xff) - green;
+    const int db = static_cast<int>(color & 0xff) - blue;
+    return dr * dr + dg * dg + db * db;
+  };
+  auto cube_level = [](int value) {
+    unsigned level = 0;
+    while (level < 5 && (cube_levels[level] + cube_levels[level + 1]) < 2 * value) {
+      level++;
+    }
+    return level;
+  };
+  for (unsigned i = 0; i < (1 << 15); i++) {
+    const int red = ((i >> 10) << 3) | 4;
+    const int green = (((i >> 5) & 0x1f) << 3) | 4;
+    const int blue = ((i & 0x1f) << 3) | 4;
+    const int sum = red + green + blue;
+    const unsigned candidates[CUBE_COLORS + 2] = {
+      0, 1, 2, 3, 4, 5, 6,
+      CUBE_COLORS + 36 * cube_level(red) + 6 * cube_level(green) + cube_level(blue),
+      GRAY_COLORS + ((sum < 9) ? 0 : min((sum - 9) / 30, 23))
+    };
+    unsigned best = candidates[CUBE_COLORS];
+    for (unsigned candidate : candidates) {
+      if (distance(xterm_color(candidate), red, green, blue) < distance(xterm_color(best), red, green, blue)) {
+        best = candidate;
+      }
+    }
+    closest_colors[i] = best;
   }
-  const uint8_t* bytes() const { return (uint8_t*) _buf; }
+}
 
-private:
-  char _buf[4];
+// The colors of the terminal are given in the byte order of
+// SetPalette32(), with red in the lowest byte.  The monochrome schemes
+// show the xterm colors in shades of their bold color, like a phosphor
+// screen would.
+struct ColorScheme {
+  const char* _name;
+  Framebuffer::ColorDefinitions _colors;
+  bool _monochrome;
 };
 
-void
-Framebuffer::flush()
+static const ColorScheme color_schemes[] = {
+  { "gray", { 0x000000, 0x808080, 0xffffff, 0x0000ff }, false },
+  { "green", { 0x000000, 0x20c020, 0x60ff60, 0x20c020 }, true },
+  { "amber", { 0x000000, 0x00a0ff, 0x60d0ff, 0x00a0ff }, true },
+};
+
+// Brightness levels in percent
+static const unsigned brightness_levels[] = { 100, 80, 60, 40 };
+
+// Time for which the screen is shown in reverse video by the visual bell
+static const unsigned FLASH_DURATION = 100000;
+
+static inline uint32_t
+scale_color(uint32_t color, unsigned numerator, unsigned denominator)
+{
+  return ((((color >> 16) & 0xff) * numerator / denominator) << 16)
+    | ((((color >> 8) & 0xff) * numerator / denominator) << 8)
+    | ((color & 0xff) * numerator / denominator);
+}
+
+GFX_COL
+Framebuffer::color_index(const VTermColor& color)
+{
+  return ColorIndex::xterm + closest_colors[((color.red >> 3) << 10) | ((color.green >> 3) << 5) | (color.blue >> 3)];
+}
+
+static inline bool
+same_color(const VTermColor& a, const VTermColor& b)
 {
-  _channel.Start();
-  _channel.Wait();
+  return a.red == b.red && a.green == b.green && a.blue == b.blue;
 }
 
 void
-Framebuffer::set_xterm_colors()
+Framebuffer::set_default_colors(const VTermColor& foreground,
+                                const VTermColor& background)
 {
-  static const unsigned int xterm_colors[256] = {
-    0x000000, 0x800000, 0x008000, 0x808000, 0x000080, 0x800080, 0x008080,
-    0xc0c0c0, 0x808080, 0xff0000, 0x00ff00, 0xffff00, 0x0000ff, 0xff00ff,
-    0x00ffff, 0xffffff, 0x000000, 0x00005f, 0x000087, 0x0000af, 0x0000df,
-    0x0000ff, 0x005f00, 0x005f5f, 0x005f87, 0x005faf, 0x005fdf, 0x005fff,
-    0x008700, 0x00875f, 0x008787, 0x0087af, 0x0087df, 0x0087ff, 0x00af00,
-    0x00af5f, 0x00af87, 0x00afaf, 0x00afdf, 0x00afff, 0x00df00, 0x00df5f,
-    0x00df87, 0x00dfaf, 0x00dfdf, 0x00dfff, 0x00ff00, 0x00ff5f, 0x00ff87,
-    0x00ffaf, 0x00ffdf, 0x00ffff, 0x5f0000, 0x5f005f, 0x5f0087, 0x5f00af,
-    0x5f00df, 0x5f00ff, 0x5f5f00, 0x5f5f5f, 0x5f5f87, 0x5f5faf, 0x5f5fdf,
-    0x5f5fff, 0x5f8700, 0x5f875f, 0x5f8787, 0x5f87af, 0x5f87df, 0x5f87ff,
-    0x5faf00, 0x5faf5f, 0x5faf87, 0x5fafaf, 0x5fafdf, 0x5fafff, 0x5fdf00,
-    0x5fdf5f, 0x5fdf87, 0x5fdfaf, 0x5fdfdf, 0x5fdfff, 0x5fff00, 0x5fff5f,
-    0x5fff87, 0x5fffaf, 0x5fffdf, 0x5fffff, 0x870000, 0x87005f, 0x870087,
-    0x8700af, 0x8700df, 0x8700ff, 0x875f00, 0x875f5f, 0x875f87, 0x875faf,
-    0x875fdf, 0x875fff, 0x878700, 0x87875f, 0x878787, 0x8787af, 0x8787df,
-    0x8787ff, 0x87af00, 0x87af5f, 0x87af87, 0x87afaf, 0x87afdf, 0x87afff,
-    0x87df00, 0x87df5f, 0x87df87, 0x87dfaf, 0x87dfdf, 0x87dfff, 0x87ff00,
-    0x87ff5f, 0x87ff87, 0x87ffaf, 0x87ffdf, 0x87ffff, 0xaf0000, 0xaf005f,
-    0xaf0087, 0xaf00af, 0xaf00df, 0xaf00ff, 0xaf5f00, 0xaf5f5f, 0xaf5f87,
-    0xaf5faf, 0xaf5fdf, 0xaf5fff, 0xaf8700, 0xaf875f, 0xaf8787, 0xaf87af,
-    0xaf87df, 0xaf87ff, 0xafaf00, 0xafaf5f, 0xafaf87, 0xafafaf, 0xafafdf,
-    0xafafff, 0xafdf00, 0xafdf5f, 0xafdf87, 0xafdfaf, 0xafdfdf, 0xafdfff,
-    0xafff00, 0xafff5f, 0xafff87, 0xafffaf, 0xafffdf, 0xafffff, 0xdf0000,
-    0xdf005f, 0xdf0087, 0xdf00af, 0xdf00df, 0xdf00ff, 0xdf5f00, 0xdf5f5f,
-    0xdf5f87, 0xdf5faf, 0xdf5fdf, 0xdf5fff, 0xdf8700, 0xdf875f, 0xdf8787,
-    0xdf87af, 0xdf87df, 0xdf87ff, 0xdfaf00, 0xdfaf5f, 0xdfaf87, 0xdfafaf,
-    0xdfafdf, 0xdfafff, 0xdfdf00, 0xdfdf5f, 0xdfdf87, 0xdfdfaf, 0xdfdfdf,
-    0xdfdfff, 0xdfff00, 0xdfff5f, 0xdfff87, 0xdfffaf, 0xdfffdf, 0xdfffff,
-    0xff0000, 0xff005f, 0xff0087, 0xff00af, 0xff00df, 0xff00ff, 0xff5f00,
-    0xff5f5f, 0xff5f87, 0xff5faf, 0xff5fdf, 0xff5fff, 0xff8700, 0xff875f,
-    0xff8787, 0xff87af, 0xff87df, 0xff87ff, 0xffaf00, 0xffaf5f, 0xffaf87,
-    0xffafaf, 0xffafdf, 0xffafff, 0xffdf00, 0xffdf5f, 0xffdf87, 0xffdfaf,
-    0xffdfdf, 0xffdfff, 0xffff00, 0xffff5f, 0xffff87, 0xffffaf, 0xffffdf,
-    0xffffff, 0x080808, 0x121212, 0x1c1c1c, 0x262626, 0x303030, 0x3a3a3a,
-    0x444444, 0x4e4e4e, 0x585858, 0x606060, 0x666666, 0x767676, 0x808080,
-    0x8a8a8a, 0x949494, 0x9e9e9e, 0xa8a8a8, 0xb2b2b2, 0xbcbcbc, 0xc6c6c6,
-    0xd0d0d0, 0xdadada, 0xe4e4e4, 0xeeeeee
-  };
+  _default_foreground = foreground;
+  _default_background = background;
+}
 
-  for (int i = 0; i < 256; i++) {
-    _framebuffer->SetPalette32(i, ((xterm_colors[i] & 0xff0000) >> 16) | (xterm_colors[i] & 0x00ff00) | ((xterm_colors[i] & 0x0000ff) << 16));
-  }
+GFX_COL
+Framebuffer::foreground_index(const VTermColor& color) const
+{
+  return same_color(color, _default_foreground) ? GFX_COL(ColorIndex::normal) : color_index(color);
+}
 
-  _framebuffer->UpdatePalette();
+GFX_COL
+Framebuffer::background_index(const VTermColor& color) const
+{
+  return same_color(color, _default_background) ? GFX_COL(ColorIndex::background) : color_index(color);
 }
 
 Framebuffer::Framebuffer(unsigned int width,
                          unsigned int height)
   :  Logging("Framebuffer"),
-     _channel(DMA_CHANNEL_NORMAL),
      _timer(CTimer::Get()),
-     _cursor(this, _timer),
-     _color_definitions({ 0x000000, 0x808080, 0xffffff, 0x0000ff }),
-     _glyph_cache(GLYPH_CACHE_SIZE)
+     _scheduler(_timer),
+     _flash_event(end_flash_stub, this),
+     _color_scheme(0),
+     _brightness(0),
+     _reverse_video(false),
+     _flash(false),
+     _default_foreground({ 240, 240, 240 }),
+     _default_background({ 0, 0, 0 }),
+     _masks(new uint32_t[GLYPH_KEYS * Font::height]),
+     _masks_rendered(new bool[GLYPH_KEYS]())
 {
-  _framebuffer = new CBcmFrameBuffer(width, height, 8);
+  _framebuffer = new CBcmFrameBuffer(width, height, 8, width, height * SCROLL_SCREENS);
   if (!_framebuffer->Initialize()) {
     log(LogError, "Framebuffer initialization failed");
   }
@@ -110,23 +185,47 @@ Framebuffer::Framebuffer(unsigned int width,
   _width = width;
   _height = height - (border_top_bottom * 2);
   _pitch = _framebuffer->GetPitch();
+  _border = border_top_bottom;
+
+  // The screen is moved over the virtual frame buffer by up to a screen
+  // height at a time, so at least three screen heights are needed for
+  // the copy back to the other end not to overlap.
+  _scroll_mode = (_framebuffer->GetVirtHeight() >= 3 * height) ? ScrollMode::Pan : ScrollMode::Copy;
+  _scroll_y = _displayed_scroll_y = 0;
 
   log(LogDebug,
-      "Framebuffer initialized, _width=%u _height=%u lines=%u border_top_bottom=%u _pitch=%u",
-      _width, _height, lines, border_top_bottom, _pitch);
+      "Framebuffer initialized, _width=%u _height=%u lines=%u border_top_bottom=%u _pitch=%u virtual height=%u",
+      _width, _height, lines, border_top_bottom, _pitch, _framebuffer->GetVirtHeight());
 
   _pfb = reinterpret_cast<uint8_t*>(_framebuffer->GetBuffer() + (border_top_bottom * _pitch));
 
-  _glyph_cache.monitor();
-
-  _framebuffer->SetPalette32(ColorIndex::background, _color_definitions._background);
-  _framebuffer->SetPalette32(ColorIndex::normal, _color_definitions._text);
-  _framebuffer->SetPalette32(ColorIndex::bold, _color_definitions._bold);
-  _framebuffer->SetPalette32(ColorIndex::blinkNormal, _color_definitions._text);
-  _framebuffer->SetPalette32(ColorIndex::blinkBold, _color_definitions._bold);
-  _framebuffer->SetPalette32(ColorIndex::cursor, _color_definitions._cursor);
+  // The transfers are timed on rows below the screen if the virtual
+  // frame buffer has them.  Otherwise, the top of the screen is used,
+  // which is cleared right afterwards.
+  uint8_t* calibration_rows = reinterpret_cast<uint8_t*>(_framebuffer->GetBuffer());
+  if (_framebuffer->GetVirtHeight() >= height + font_height()) {
+    calibration_rows += height * _pitch;
+  }
+  _dma.calibrate(calibration_rows, _pitch);
+
+  // Everything outside of the displayed text area must have the
+  // background color when panning.
+  _dma.fill(reinterpret_cast<uint8_t*>(_framebuffer->GetBuffer()),
+            ColorIndex::background,
+            _pitch,
+            _framebuffer->GetVirtHeight());
+
+  _span_width = 0;
+  _fill_height = 0;
+
+  static bool closest_colors_found = false;
+  if (!closest_colors_found) {
+    find_closest_colors();
+    closest_colors_found = true;
+  }
 
-  _framebuffer->UpdatePalette();
+  update_palette();
+  _scheduler.add(_flash_event);
 }
 
 void
@@ -138,249 +237,374 @@ Framebuffer::move_rect(unsigned int from_row,
                        unsigned int columns,
                        __unused GFX_COL background_color)
 {
-  _cursor.remove_from_screen();
-  unsigned int width = columns * font_width();
-  unsigned int height = rows * font_height();
-
-  log(LogDebug, "Move width %u height %u, setting up DMA", width, height);
-  _channel.SetupMemCopy2D(fb_pointer(from_column * font_width(), from_row * font_height()),
-                          fb_pointer(to_column * font_width(), to_row * font_height()),
-                          width, height,
-                          _pitch - width, _pitch - width,
-                          0);
-  log(LogDebug, "Starting DMA");
-  flush();
-  log(LogDebug, "Save new cursor content");
+  if (_scroll_mode == ScrollMode::Pan
+      && from_column == 0
+      && to_column == 0
+      && columns * font_width() == _width
+      && min(from_row, to_row) == 0
+      && max(from_row, to_row) + rows == _height / font_height()) {
+    pan(from_row - to_row);
+    return;
+  }
+
+  update();
+
+  const unsigned int width = columns * font_width();
+  const unsigned int height = rows * font_height();
+  uint8_t* from = fb_pointer(from_column * font_width(), from_row * font_height());
+  uint8_t* to = fb_pointer(to_column * font_width(), to_row * font_height());
+
+  Trace::record(TraceMoveRect, from_row, from_column, to_row, to_column, rows, columns);
+
+  if (to_row > from_row) {
+    // Moving down, copy the rows bottom up so that they are read
+    // before they are overwritten.
+    const int stride = -static_cast<int>(_pitch + width);
+    _dma.copy(to + (height - 1) * _pitch, from + (height - 1) * _pitch,
+              width, height,
+              stride, stride);
+  } else if (to_row == from_row && to_column > from_column) {
+    // Moving right within the same rows.  The controller copies each
+    // row front to back, so go through a staging buffer.
+    uint8_t* buffer = _dma.allocate(width * height, 2);
+    _dma.copy(buffer, from,
+              width, height,
+              0, _pitch - width);
+    _dma.copy(to, buffer,
+              width, height,
+              _pitch - width, 0);
+  } else {
+    _dma.copy(to, from,
+              width, height,
+              _pitch - width, _pitch - width);
+  }
 }
 
-Framebuffer::Glyph::Glyph(const unsigned char c,
-                          __unused const GFX_COL _foreground_color,
-                          __unused const GFX_COL _background_color,
-                          const VTermScreenCellAttrs attributes)
+// Scrolls the whole screen up by the given number of rows, or down if
+// it is negative.  Everything outside of the text area is kept at the
+// background color, so only the rows that leave the text area need to
+// be cleared.
+void
+Framebuffer::pan(int rows)
 {
-  const unsigned font_width = Framebuffer::font_width();
-  const unsigned font_height = Framebuffer::font_height();
+  update();
+
+  const int delta = rows * static_cast<int>(font_height());
+  const unsigned int kept = _height - abs(delta);
+  const unsigned int kept_offset = abs(delta) * _pitch;
+  const unsigned int screen_height = _height + 2 * _border;
+  int scroll_y = static_cast<int>(_scroll_y) + delta;
+
+  Trace::record(TracePan, rows, _scroll_y);
+
+  if (scroll_y < 0 || scroll_y + screen_height > _framebuffer->GetVirtHeight()) {
+    // Continue at the other end of the virtual frame buffer
+    scroll_y = (delta > 0) ? 0 : (_framebuffer->GetVirtHeight() - screen_height);
+    uint8_t* pfb = reinterpret_cast<uint8_t*>(_framebuffer->GetBuffer() + (scroll_y + _border) * _pitch);
+    if (delta > 0) {
+      _dma.copy(pfb, _pfb + kept_offset,
+                _width, kept,
+                _pitch - _width, _pitch - _width);
+    } else {
+      _dma.copy(pfb + kept_offset, _pfb,
+                _width, kept,
+                _pitch - _width, _pitch - _width);
+    }
+    _dma.fill(_pfb, ColorIndex::background, _width, _height, _pitch - _width);
+    _pfb = pfb;
+  } else {
+    if (delta > 0) {
+      _dma.fill(_pfb, ColorIndex::background, _width, delta, _pitch - _width);
+      _pfb += kept_offset;
+    } else {
+      _dma.fill(_pfb + kept * _pitch, ColorIndex::background, _width, -delta, _pitch - _width);
+      _pfb -= kept_offset;
+    }
+  }
 
-  _width = font_width * (attributes.dwl ? 2 : 1);
-  _height = font_height;
+  _scroll_y = scroll_y;
+}
 
-  _data = new uint8_t[_width * _height];
+uint8_t
+Framebuffer::glyph_attributes(const VTermScreenCellAttrs attributes,
+                              bool cursor)
+{
+  // These are the attributes that putc() looks at.  The height
+  // attribute only matters for double width lines.
+  return attributes.bold
+    | ((attributes.underline != 0) << 1)
+    | (attributes.blink ? BLINK_ATTRIBUTE : 0)
+    | (attributes.reverse << 3)
+    | (attributes.conceal << 4)
+    | (glyph_size(attributes) << 5)
+    | (cursor << 7);
+}
 
-  GFX_COL foreground_color = attributes.bold ? ColorIndex::bold : (attributes.conceal ? ColorIndex::background : ColorIndex::normal);
-  if (attributes.blink && !attributes.conceal) {
-    foreground_color += 2;
+unsigned int
+Framebuffer::glyph_key(const unsigned char c,
+                       const VTermScreenCellAttrs attributes)
+{
+  return c | ((attributes.underline != 0) << 8) | (glyph_size(attributes) << 9);
+}
+
+const uint32_t*
+Framebuffer::get_glyph(const unsigned char c,
+                       const VTermScreenCellAttrs attributes)
+{
+  const unsigned int key = glyph_key(c, attributes);
+  uint32_t* rows = _masks + key * Font::height;
+  if (_masks_rendered[key]) {
+    Counters::add(Counters::GlyphHits);
+    return rows;
+  }
+
+  Counters::add(Counters::GlyphMisses);
+  Font::mask(rows, c, glyph_size(attributes), attributes.underline);
+  _masks_rendered[key] = true;
+
+  return rows;
+}
+
+void
+Framebuffer::cell_colors(GFX_COL& foreground_color,
+                         GFX_COL& background_color,
+                         const VTermScreenCellAttrs attributes,
+                         bool cursor)
+{
+  // Bold text in the default color uses its own palette entry
+  if (foreground_color == ColorIndex::normal && attributes.bold) {
+    foreground_color = ColorIndex::bold;
+  }
+  if (attributes.conceal) {
+    foreground_color = background_color;
   }
-  GFX_COL background_color = 0;
   if (attributes.reverse) {
     swap(foreground_color, background_color);
   }
+  if (cursor) {
+    foreground_color = ColorIndex::background;
+    background_color = ColorIndex::cursor;
+  }
+}
 
-  uint8_t* p_font_glyph = G_FONT_GLYPHS + c * font_width * font_height;
-  uint8_t* p = _data;
-
-  auto get_font_data = [=](unsigned x, unsigned y) {
-    if (attributes.underline && y == (font_height - 1)) {
-      return foreground_color;
-    } else {
-      return p_font_glyph[y * font_width + x] ? foreground_color : background_color;
-    }
-  };
-
+bool
+Framebuffer::solid(const unsigned char c,
+                   GFX_COL foreground_color,
+                   GFX_COL background_color,
+                   const VTermScreenCellAttrs attributes,
+                   GFX_COL& color)
+{
   if (attributes.dwl) {
-    switch (attributes.dhl) {
-    case 0:
-      // Double width
-      for (unsigned y = 0; y < font_height; y++) {
-        for (unsigned x = 0; x < font_width; x++) {
-          const uint8_t color = get_font_data(x, y);
-          *p++ = color;
-          *p++ = color;
-        }
-      }
-      break;
-    case 1:
-      // Double width and double height, top half
-      for (unsigned y = 0; y < font_height / 2; y++) {
-        for (unsigned i = 0; i < 2; i++) {
-          for (unsigned x = 0; x < font_width; x++) {
-            const uint8_t color = get_font_data(x, y);
-            *p++ = color;
-            *p++ = color;
-          }
-        }
-      }
-      break;
-    case 2:
-      // Double width and double height, bottom half
-      for (unsigned y = font_height / 2; y < font_height; y++) {
-        for (unsigned i = 0; i < 2; i++) {
-          for (unsigned x = 0; x < font_width; x++) {
-            const uint8_t color = get_font_data(x, y);
-            *p++ = color;
-            *p++ = color;
-          }
-        }
-      }
-      break;
-    }
-  } else {
-      for (unsigned y = 0; y < font_height; y++) {
-        for (unsigned x = 0; x < font_width; x++) {
-          const uint8_t color = get_font_data(x, y);
-          *p++ = color;
-        }
-      }
+    return false;
   }
+  cell_colors(foreground_color, background_color, attributes, false);
+  color = background_color;
+  return foreground_color == background_color || (Font::blank(c) && !attributes.underline);
 }
 
-shared_ptr<Framebuffer::Glyph>
-Framebuffer::get_glyph(const unsigned char c,
-                       const GFX_COL foreground_color,
-                       const GFX_COL background_color,
-                       const VTermScreenCellAttrs attributes)
+void
+Framebuffer::fill_rect(unsigned int row,
+                       unsigned int column,
+                       unsigned int rows,
+                       unsigned int columns,
+                       GFX_COL color)
 {
-  shared_ptr<Glyph> glyph;
-  union {
-    VTermScreenCellAttrs attrs;
-    uint16_t binary;
-  } cast_attributes;
-  cast_attributes.attrs = attributes;
-  const auto key = GlyphKey(c, foreground_color, background_color, cast_attributes.binary);
-  if (_glyph_cache.contains(key)) {
-    glyph = _glyph_cache.lookup(key);
-  } else {
-    glyph = make_shared<Glyph>(c, foreground_color, background_color, attributes);
-    _glyph_cache.emplace(key, glyph);
+  const unsigned x = column * font_width();
+  const unsigned y = row * font_height();
+  const unsigned width = columns * font_width();
+  const unsigned height = rows * font_height();
+
+  if (_fill_height
+      && x == _fill_x
+      && width == _fill_width
+      && y == _fill_y + _fill_height
+      && color == _fill_color) {
+    _fill_height += height;
+    return;
   }
 
-  return glyph;
+  flush_fill();
+  _fill_x = x;
+  _fill_y = y;
+  _fill_width = width;
+  _fill_height = height;
+  _fill_color = color;
+}
+
+void
+Framebuffer::flush_fill()
+{
+  if (_fill_height) {
+    _dma.fill(fb_pointer(_fill_x, _fill_y),
+              _fill_color,
+              _fill_width,
+              _fill_height,
+              _pitch - _fill_width);
+    _fill_height = 0;
+  }
 }
 
 void
 Framebuffer::putc(const unsigned row,
                   const unsigned column,
                   const unsigned char c,
-                  __unused const VTermColor& foreground_color,
-                  __unused const VTermColor& background_color,
-                  const VTermScreenCellAttrs attributes)
+                  GFX_COL foreground_color,
+                  GFX_COL background_color,
+                  const VTermScreenCellAttrs attributes,
+                  bool cursor)
 {
-  GFX_COL foreground_color_index = ColorIndex::normal;
-  GFX_COL background_color_index = ColorIndex::background;
-  shared_ptr<Glyph> glyph = get_glyph(c, foreground_color_index, background_color_index, attributes);
-
-  _channel.SetupMemCopy2D(fb_pointer(column * glyph->_width, row * glyph->_height),
-                          glyph->_data,
-                          glyph->_width,
-                          glyph->_height,
-                          _pitch - glyph->_width);
-  flush();
+  const unsigned glyph_width = font_width() * (attributes.dwl ? 2 : 1);
+  const unsigned x = column * glyph_width;
+  const unsigned y = row * font_height();
+
+  // The right half of a double width line is not visible
+  if (x + glyph_width > _width) {
+    return;
+  }
+
+  cell_colors(foreground_color, background_color, attributes, cursor);
+
+  const uint32_t* rows = get_glyph(c, attributes);
+
+  if (_span_width
+      && (y != _span_y
+          || x != _span_x + _span_width
+          || _span_width + glyph_width > _width)) {
+    update();
+  }
+  if (_span_width == 0) {
+    _dma.allocate(_width * font_height());
+    _span_x = x;
+    _span_y = y;
+  }
+
+  // Fills may move the span buffer to the next DMA batch
+  Font::expand(_dma.allocation() + _span_width, _width, rows, glyph_width, foreground_color, background_color);
+  _span_width += glyph_width;
 }
 
 void
-Framebuffer::set_cursor(unsigned int row,
-                        unsigned int column,
-                        bool visible,
-                        bool double_width)
+Framebuffer::update()
 {
-  _cursor.set(row, column, visible, double_width);
+  // Glyphs may have been rendered on top of the filled area
+  flush_fill();
+
+  if (_span_width) {
+    _dma.copy(fb_pointer(_span_x, _span_y),
+              _dma.allocation(),
+              _span_width,
+              font_height(),
+              _pitch - _span_width,
+              _width - _span_width);
+    _span_width = 0;
+  }
+
+  if (_scroll_y != _displayed_scroll_y) {
+    // Show the new position only after the transfers for it are done
+    _dma.sync();
+    _framebuffer->SetVirtualOffset(0, _scroll_y);
+    _displayed_scroll_y = _scroll_y;
+  }
+
+  _dma.kick();
 }
 
+// Writes all palette entries from the color scheme, the brightness and
+// the reverse video state.  No pixels are touched.
 void
-Framebuffer::handle_blinking()
+Framebuffer::update_palette()
 {
-  if ((_timer->GetTicks() % HZ) < (HZ / 2)) {
-    _framebuffer->SetPalette32(3, _color_definitions._text);
-    _framebuffer->SetPalette32(4, _color_definitions._bold);
-  } else {
-    _framebuffer->SetPalette32(3, _color_definitions._background);
-    _framebuffer->SetPalette32(4, _color_definitions._background);
+  const ColorScheme& scheme = color_schemes[_color_scheme];
+  const ColorDefinitions& colors = scheme._colors;
+  const unsigned brightness = brightness_levels[_brightness];
+  // The visual bell inverts whatever is shown
+  const bool reverse = _reverse_video != _flash;
+
+  for (unsigned i = 0; i < 256; i++) {
+    uint32_t color = 0;
+    switch (i) {
+    case ColorIndex::background:
+      color = reverse ? colors._text : colors._background;
+      break;
+    case ColorIndex::normal:
+      color = reverse ? colors._background : colors._text;
+      break;
+    case ColorIndex::bold:
+      // Nothing is darker than the background that normal text takes
+      // on, so bold text is set apart by a dark shade of its color
+      color = reverse ? scale_color(colors._bold, 1, 4) : colors._bold;
+      break;
+    case ColorIndex::cursor:
+      color = colors._cursor;
+      break;
+    default:
+      if (i >= ColorIndex::xterm && i < ColorIndex::xterm + XTERM_COLORS) {
+        const uint32_t rgb = xterm_color(i - ColorIndex::xterm);
+        if (scheme._monochrome) {
+          const unsigned luminance = (299 * (rgb >> 16) + 587 * ((rgb >> 8) & 0xff) + 114 * (rgb & 0xff)) / 1000;
+          color = scale_color(colors._bold, luminance, 255);
+        } else {
+          color = ((rgb & 0xff0000) >> 16) | (rgb & 0x00ff00) | ((rgb & 0x0000ff) << 16);
+        }
+      }
+      break;
+    }
+    _framebuffer->SetPalette32(i, scale_color(color, brightness, 100));
   }
 
+  Counters::add(Counters::PaletteUpdates);
   _framebuffer->UpdatePalette();
 }
 
 void
-Framebuffer::process()
+Framebuffer::set_reverse_video(bool reverse)
 {
-  _cursor.process();
-  handle_blinking();
+  if (reverse != _reverse_video) {
+    _reverse_video = reverse;
+    update_palette();
+  }
 }
 
-Framebuffer::Cursor::Cursor(Framebuffer* framebuffer, CTimer* timer)
-  : _framebuffer(framebuffer),
-    _timer(timer),
-    _last_activity(timer->GetTicks()),
-    _row(0),
-    _column(0),
-    _visible(true),
-    _double_width(false),
-    _blink_state(false)
+const char*
+Framebuffer::cycle_color_scheme()
 {
-  _buffer = new uint8_t[Framebuffer::font_height() + Framebuffer::font_width() * 2];
+  _color_scheme = (_color_scheme + 1) % (sizeof color_schemes / sizeof color_schemes[0]);
+  update_palette();
+  return color_schemes[_color_scheme]._name;
 }
 
-uint8_t*
-Framebuffer::Cursor::fb_pointer()
+unsigned
+Framebuffer::cycle_brightness()
 {
-  return _framebuffer->fb_pointer(_column * Framebuffer::font_width() * (_double_width ? 2 : 1),
-                                  _row * Framebuffer::font_height());
+  _brightness = (_brightness + 1) % (sizeof brightness_levels / sizeof brightness_levels[0]);
+  update_palette();
+  return brightness_levels[_brightness];
 }
 
 void
-Framebuffer::Cursor::set(unsigned row, unsigned column, bool visible, bool double_width)
+Framebuffer::flash()
 {
-  remove_from_screen();
-
-  _last_activity = _timer->GetTicks();
-  _row = row;
-  _column = column;
-  _visible = visible;
-  _double_width = double_width;
-
-  _framebuffer->log(LogDebug, "Set cursor to %d/%d (visible %d double_width %d)", row, column, visible, double_width);
+  _flash = true;
+  update_palette();
+  _scheduler.schedule(_flash_event, _scheduler.now() + FLASH_DURATION);
 }
 
 void
-Framebuffer::Cursor::process()
+Framebuffer::end_flash()
 {
-  const unsigned blink_period = _blink_freq * HZ;
-  const bool blink_state = ((_timer->GetTicks() - _last_activity) % blink_period) < (blink_period / 2);
-
-  if (_blink_state != blink_state) {
-    _framebuffer->log(LogDebug, "Cursor %d/%d blink state changed to %d", _row, _column, blink_state);
-
-    uint8_t* pb = _buffer;
-    uint8_t* pfb = fb_pointer();
-
-    for (unsigned y = 0; y < Framebuffer::font_height(); y++) {
-      for (unsigned x = 0; x < Framebuffer::font_width() * (_double_width ? 2 : 1); x++) {
-        if (blink_state && _visible) {
-          *pb++ = pfb[x];
-          pfb[x] = ColorIndex::cursor;
-        } else {
-          pfb[x] = *pb++;
-        }
-      }
-      pfb += _framebuffer->pitch();
-    }
-
-    _blink_state = blink_state;
-  }
+  _flash = false;
+  update_palette();
 }
 
 void
-Framebuffer::Cursor::remove_from_screen()
+Framebuffer::end_flash_stub(void* framebuffer)
 {
-  uint8_t* pb = _buffer;
-  uint8_t* pfb = fb_pointer();
+  reinterpret_cast<Framebuffer*>(framebuffer)->end_flash();
+}
 
-  if (_blink_state && _visible) {
-    for (unsigned y = 0; y < Framebuffer::font_height(); y++) {
-      for (unsigned x = 0; x < Framebuffer::font_width() * (_double_width ? 2 : 1); x++) {
-        pfb[x] = *pb++;
-      }
-      pfb += _framebuffer->pitch();
-    }
-  }
-  _blink_state = false;
+void
+Framebuffer::process()
+{
+  _dma.kick();
+  _scheduler.run();
 }
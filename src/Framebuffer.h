@@ -2,13 +2,6 @@
 
 #pragma once
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wreorder"
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-#include <lru/lru.hpp>
-#pragma GCC diagnostic pop
-
-#include <circle/dmachannel.h>
 #include <circle/bcmframebuffer.h>
 
 #include <iostream>
@@ -16,6 +9,9 @@
 #include <vterm.h>
 
 #include "Logging.h"
+#include "DMAQueue.h"
+#include "Font.h"
+#include "Scheduler.h"
 
 using namespace std;
 
@@ -28,12 +24,48 @@ public:
   Framebuffer(unsigned int width = 800,
               unsigned int height = 600);
 
+  // Glyphs written by putc() are collected in a span buffer while they
+  // are adjacent on the same row.  Each span is handed to the DMA queue
+  // as one transfer when it is complete or when update() is called.
+  // update() also starts queued transfers without waiting for them.
+  // The colors are palette indices as returned by foreground_index()
+  // and background_index(), the attributes are applied to them.  The
+  // cursor is shown by rendering the cell below it with the cursor
+  // flag, which uses the cursor color as the background.
   void putc(const unsigned row,
             const unsigned column,
             const unsigned char c,
-            const VTermColor& foreground_color,
-            const VTermColor& background_color,
-            const VTermScreenCellAttrs attributes);
+            GFX_COL foreground_color,
+            GFX_COL background_color,
+            const VTermScreenCellAttrs attributes,
+            bool cursor = false);
+
+  // libvterm reports colors as RGB values.  Its default colors are
+  // shown in the configured text and background colors, all others in
+  // the closest color of the xterm palette.
+  void set_default_colors(const VTermColor& foreground,
+                          const VTermColor& background);
+  GFX_COL foreground_index(const VTermColor& color) const;
+  GFX_COL background_index(const VTermColor& color) const;
+
+  // Whether a cell is shown in one color only, which is then stored in
+  // color.  That is the case for blank and concealed characters.  Cells
+  // of double width lines are not considered.
+  static bool solid(const unsigned char c,
+                    GFX_COL foreground_color,
+                    GFX_COL background_color,
+                    const VTermScreenCellAttrs attributes,
+                    GFX_COL& color);
+
+  // Fills cells with one color.  The fill is queued as one DMA transfer
+  // that reads the same word over and over.  Fills of the same columns
+  // on consecutive rows are combined until update() is called.  Glyphs
+  // written to the filled cells afterwards are shown on top.
+  void fill_rect(unsigned int row,
+                 unsigned int column,
+                 unsigned int rows,
+                 unsigned int columns,
+                 GFX_COL color);
 
   void move_rect(unsigned int from_row,
                  unsigned int from_column,
@@ -43,20 +75,45 @@ public:
                  unsigned int columns,
                  GFX_COL background_color);
 
-  void remove_cursor() { _cursor.remove_from_screen(); }
-
-  void set_cursor(unsigned int row,
-                  unsigned int column,
-                  bool visible,
-                  bool double_width);
+  // Starts queued transfers and shows the screen at the current
+  // virtual offset.
+  void update();
 
+  // Runs the events that are due
   void process();
 
+  // Screen wide modes are applied by rewriting the palette, which takes
+  // the same time whatever the screen shows.  The reverse video mode is
+  // DECSCNM.  The visual bell shows the screen in reverse video for a
+  // moment.
+  void set_reverse_video(bool reverse);
+  const char* cycle_color_scheme();
+  unsigned cycle_brightness();
+  void flash();
+
+  // The attributes that make a difference in how a character is
+  // rendered, packed into one byte
+  static uint8_t glyph_attributes(const VTermScreenCellAttrs attributes,
+                                  bool cursor);
+  static const uint8_t BLINK_ATTRIBUTE = 1 << 2;
+
+  Scheduler& scheduler() { return _scheduler; }
+
   unsigned int width() const { return _width; }
   unsigned int height() const { return _height; }
   unsigned int pitch() const { return _pitch; }
-  static unsigned int font_width() { return 10; }
-  static unsigned int font_height() { return 20; }
+  static unsigned int font_width() { return Font::width; }
+  static unsigned int font_height() { return Font::height; }
+
+  // Scrolling the whole screen either copies its contents or pans the
+  // displayed window over a taller virtual frame buffer.  Panning is
+  // used when the firmware provides enough virtual height.
+  enum class ScrollMode {
+    Copy,
+    Pan
+  };
+
+  ScrollMode scroll_mode() const { return _scroll_mode; }
 
   struct ColorDefinitions {
     uint32_t _background;
@@ -67,85 +124,81 @@ public:
 
 private:
 
-  class Cursor {
-  public:
-    Cursor(Framebuffer* framebuffer, CTimer* timer);
-
-    void process();
-
-    void remove_from_screen();
-
-    void set(unsigned row, unsigned column, bool visible, bool double_width);
-
-  private:
-    const float _blink_freq = 1.5;
-
-    Framebuffer* _framebuffer;
-    CTimer* _timer;
-    unsigned int _last_activity;
-    unsigned int _row;
-    unsigned int _column;
-    bool _visible;
-    bool _double_width;
-    uint8_t* _buffer;
-
-    bool _blink_state;
-
-    uint8_t* fb_pointer();
-  };
-
-  struct Glyph
-  {
-    Glyph(const unsigned char c,
-          const GFX_COL foreground_color,
-          const GFX_COL background_color,
-          const VTermScreenCellAttrs attributes);
-    ~Glyph() { delete _data; }
-
-    unsigned int _width;
-    unsigned int _height;
-    uint8_t* _data;
-  };
-
-  CDMAChannel _channel;
+  DMAQueue _dma;
   CTimer* _timer;
   CBcmFrameBuffer* _framebuffer;
 
-  Cursor _cursor;
+  Scheduler _scheduler;
 
   uint8_t* _pfb;
   unsigned int _width;
   unsigned int _height;
   unsigned int _pitch;
 
+  ScrollMode _scroll_mode;
+  unsigned int _border;
+  unsigned int _scroll_y;
+  unsigned int _displayed_scroll_y;
+
   uint8_t* _font_data;
 
-  ColorDefinitions _color_definitions;
+  Scheduler::Event _flash_event;
+  unsigned _color_scheme;
+  unsigned _brightness;
+  bool _reverse_video;
+  bool _flash;
+  VTermColor _default_foreground;
+  VTermColor _default_background;
+
+  // The span buffer is the last allocation of the DMA queue
+  unsigned int _span_x;
+  unsigned int _span_y;
+  unsigned int _span_width;
+
+  unsigned int _fill_x;
+  unsigned int _fill_y;
+  unsigned int _fill_width;
+  unsigned int _fill_height;
+  GFX_COL _fill_color;
 
   enum ColorIndex {
                    background = 0,
                    normal,
                    bold,
-                   blinkNormal,
-                   blinkBold,
-                   cursor
+                   cursor,
+                   xterm
   };
 
-  void flush();
+  static GFX_COL color_index(const VTermColor& color);
+  void update_palette();
+  void end_flash();
+  static void end_flash_stub(void* framebuffer);
+
+  void pan(int rows);
+  void flush_fill();
 
-  void set_xterm_colors();
+  static void cell_colors(GFX_COL& foreground_color,
+                          GFX_COL& background_color,
+                          const VTermScreenCellAttrs attributes,
+                          bool cursor);
 
-  void handle_blinking();
 
   uint8_t* fb_pointer(unsigned x, unsigned y) { return _pfb + y * _pitch + x; }
 
-  using GlyphKey = tuple<char, GFX_COL, GFX_COL, unsigned long>;
-  shared_ptr<Glyph> get_glyph(const unsigned char c,
-                              const GFX_COL foreground_color,
-                              const GFX_COL background_color,
-                              const VTermScreenCellAttrs attributes);
+  // The masks of glyphs are rendered when they are first used and kept
+  // in a table that is indexed by glyph_key().  They are expanded to the
+  // colors of each cell when it is written to the span buffer, so the
+  // colors do not multiply the number of glyphs.
+  uint32_t* _masks;
+  bool* _masks_rendered;
 
-  using Cache = LRU::Cache<GlyphKey, shared_ptr<Glyph>>;
-  Cache _glyph_cache;
+  static Font::Size glyph_size(const VTermScreenCellAttrs attributes)
+  {
+    return static_cast<Font::Size>(attributes.dwl ? attributes.dhl + 1 : 0);
+  }
+  static unsigned int glyph_key(const unsigned char c,
+                                const VTermScreenCellAttrs attributes);
+  const uint32_t* get_glyph(const unsigned char c,
+                            const VTermScreenCellAttrs attributes);
 };
 
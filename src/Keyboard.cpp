@@ -5,36 +5,51 @@
 #include <cstring>
 
 #include <circle/devicenameservice.h>
+#include <circle/synchronize.h>
+#include <circle/timer.h>
 #include <circle/usb/usbkeyboard.h>
 
 using namespace std;
 
-unsigned char Keyboard::_modifiers;
-unsigned char Keyboard::_keys[6];
+RingBuffer<Keyboard::Report, Keyboard::REPORT_QUEUE_SIZE> Keyboard::_reports;
+volatile unsigned Keyboard::_dropped_reports;
 Keyboard* Keyboard::_this;
 
+// Called from the USB interrupt handler
 void
 handle_report_stub(unsigned char modifiers,
                    const unsigned char keys[6])
 {
-  Keyboard::_modifiers = modifiers;
-  memcpy(Keyboard::_keys, keys, 6);
+  Keyboard::Report report;
+  report._time = CTimer::Get()->GetClockTicks();
+  report._modifiers = modifiers;
+  memcpy(report._keys, keys, sizeof report._keys);
+  if (!Keyboard::_reports.push(report)) {
+    Keyboard::_dropped_reports++;
+  }
 }
 
-Keyboard::DeadKey Keyboard::dead_key;
+// Typematic defaults of the VT220
+static const unsigned DEFAULT_REPEAT_DELAY = 500;
+static const unsigned DEFAULT_REPEAT_RATE = 30;
 
-void
-Keyboard::initialize_keymap()
-{
+constexpr Keyboard::KeyDefinition Keyboard::_keymap[256] = {
 #include "keymap.inc"
-}
+};
 
 Keyboard::Keyboard(Terminal* terminal)
   : Logging("Keyboard"),
     _error(false),
-    _terminal(terminal)
+    _dropped_reports_logged(0),
+    _terminal(terminal),
+    _timer(CTimer::Get()),
+    _autorepeat(true),
+    _repeat_key(0),
+    _repeat_action(nullptr),
+    _repeat_due(0),
+    _repeat_timer(0)
 {
-  initialize_keymap();
+  set_typematic(DEFAULT_REPEAT_DELAY, DEFAULT_REPEAT_RATE);
 
   _usb_keyboard = (CUSBKeyboardDevice *) CDeviceNameService::Get()->GetDevice("ukbd1", FALSE);
 
@@ -47,30 +62,145 @@ Keyboard::Keyboard(Terminal* terminal)
   }
 }
 
+Keyboard::~Keyboard()
+{
+  stop_repeat();
+}
+
+void
+Keyboard::set_typematic(unsigned delay_milliseconds, unsigned characters_per_second)
+{
+  _repeat_delay = delay_milliseconds * 1000;
+  _repeat_interval = 1000000 / max(characters_per_second, 1u);
+}
+
+void
+Keyboard::set_autorepeat(bool autorepeat)
+{
+  _autorepeat = autorepeat;
+  if (!autorepeat) {
+    stop_repeat();
+  }
+}
+
 void
 Keyboard::key_pressed(unsigned char modifiers,
-                      unsigned char key_code)
+                      unsigned char key_code,
+                      unsigned time)
 {
-  if (_map.count(key_code)) {
-    auto definition = _map[key_code];
-    auto handler = definition->_solo;
-
-    if (modifiers & (Modifiers::LeftControl | Modifiers::RightControl)) {
-      handler = definition->_control;
-    } else if (modifiers & (Modifiers::LeftShift | Modifiers::RightShift)) {
-      handler = definition->_shift;
-    }
+  const KeyDefinition& definition = _keymap[key_code];
+  const KeyAction* action = &definition._solo;
 
-    auto str = (*handler)(this);
-    if (str.length()) {
-      _terminal->uart_write(str);
-    }
+  if (modifiers & (Modifiers::LeftControl | Modifiers::RightControl)) {
+    action = &definition._control;
+  } else if (modifiers & (Modifiers::LeftShift | Modifiers::RightShift)) {
+    action = &definition._shift;
+  } else if ((definition._application_mode == ApplicationCursorKeys && _terminal->application_cursor_keys())
+             || (definition._application_mode == ApplicationKeypad && _terminal->application_keypad())) {
+    action = &definition._application;
+  }
+
+  perform(*action);
+
+  // The last key pressed takes over the repetition
+  stop_repeat();
+  if (action->_action == Send && _autorepeat) {
+    start_repeat(key_code, *action, time);
   }
 }
 
 void
-Keyboard::handle_report(unsigned char modifiers,
-                        const unsigned char keys[6])
+Keyboard::start_repeat(unsigned char key_code, const KeyAction& action, unsigned time)
+{
+  EnterCritical();
+  _repeat_key = key_code;
+  _repeat_action = &action;
+  _repeat_due = time + _repeat_delay;
+  schedule_repeat();
+  LeaveCritical();
+}
+
+void
+Keyboard::stop_repeat()
+{
+  EnterCritical();
+  if (_repeat_timer) {
+    _timer->CancelKernelTimer(_repeat_timer);
+    _repeat_timer = 0;
+  }
+  _repeat_key = 0;
+  LeaveCritical();
+}
+
+// Kernel timers have a resolution of one tick, so each repetition is
+// scheduled for the tick after it is due.  As the due times advance by
+// the exact interval, the rate does not drift.
+void
+Keyboard::schedule_repeat()
+{
+  const unsigned tick = 1000000 / HZ;
+  const int delay = _repeat_due - _timer->GetClockTicks();
+  const unsigned ticks = (delay > 0) ? (delay + tick - 1) / tick : 1;
+  _repeat_timer = _timer->StartKernelTimer(ticks, repeat_handler, this);
+}
+
+void
+Keyboard::repeat_handler(__unused TKernelTimerHandle timer, void* param, __unused void* context)
+{
+  reinterpret_cast<Keyboard*>(param)->repeat();
+}
+
+// Called from the timer interrupt
+void
+Keyboard::repeat()
+{
+  _repeat_timer = 0;
+  _terminal->uart_write(_repeat_action->_sequence, _repeat_action->_length);
+  _repeat_due += _repeat_interval;
+  schedule_repeat();
+}
+
+void
+Keyboard::perform(const KeyAction& action)
+{
+  switch (action._action) {
+  case NoAction:
+    break;
+  case Send:
+    _terminal->uart_write(action._sequence, action._length);
+    break;
+  case CycleSerialSpeed:
+    _terminal->cycle_serial_speed();
+    break;
+  case ToggleScreenSize:
+    _terminal->toggle_screen_size();
+    break;
+  case CycleFlowControl:
+    _terminal->cycle_flow_control();
+    break;
+  case ToggleCounters:
+    _terminal->toggle_counters();
+    break;
+  case CycleColorScheme:
+    _terminal->cycle_color_scheme();
+    break;
+  case CycleBrightness:
+    _terminal->cycle_brightness();
+    break;
+  case ToggleCapture:
+    _terminal->toggle_capture();
+    break;
+  case ReplayCapture:
+    _terminal->replay_capture(true);
+    break;
+  case ReplayCaptureFast:
+    _terminal->replay_capture(false);
+    break;
+  }
+}
+
+void
+Keyboard::handle_report(const Report& report)
 {
   static const unsigned char error[6] = { 1, 1, 1, 1, 1, 1 };
   static const unsigned char none[6] = { 0, 0, 0, 0, 0, 0 };
@@ -78,56 +208,60 @@ Keyboard::handle_report(unsigned char modifiers,
   if (_error) {
     // When the keyboard has reported an error, wait until it sends an
     // empty report.
-    if (memcmp(keys, none, 6)) {
+    if (memcmp(report._keys, none, 6)) {
       return;
     }
     _error = false;
   }
-  if (memcmp(keys, error, 6) == 0) {
+  if (memcmp(report._keys, error, 6) == 0) {
     _error = true;
-    _keys_pressed.clear();
+    _keys_pressed.reset();
+    stop_repeat();
     return;
   }
-  set<unsigned char> keys_pressed_now;
+  bitset<256> keys_pressed_now;
   for (int i = 0; i < 6; i++) {
-    if (keys[i]) {
-      if (!_keys_pressed.count(keys[i])) {
-        key_pressed(modifiers, keys[i]);
+    const unsigned char key = report._keys[i];
+    if (key) {
+      if (!_keys_pressed[key]) {
+        key_pressed(report._modifiers, key, report._time);
       }
-      keys_pressed_now.insert(keys[i]);
+      keys_pressed_now[key] = true;
     }
   }
   _keys_pressed = keys_pressed_now;
+  if (_repeat_key && !_keys_pressed[_repeat_key]) {
+    stop_repeat();
+  }
 }
 
 void
-Keyboard::process()
+Keyboard::replay_report(unsigned char modifiers, const unsigned char keys[6])
 {
-  unsigned char modifiers;
-  unsigned char keys[6];
-
-  // Making this into a critical section is pretty heavy-handed.  It
-  // would be better to use an interrupt safe queue instead, but for
-  // now, this seems to work.
-
-  EnterCritical();
-  modifiers = _modifiers;
-  memcpy(keys, _keys, 6);
-  LeaveCritical();
-
-  handle_report(modifiers, keys);
+  Report report;
+  report._time = _timer->GetClockTicks();
+  report._modifiers = modifiers;
+  memcpy(report._keys, keys, sizeof report._keys);
+  handle_report(report);
 }
 
-const string
-Keyboard::CycleSerialSpeed::operator()(Keyboard* keyboard) const
+void
+Keyboard::process()
 {
-  keyboard->terminal()->cycle_serial_speed();
-  return "";
-}
+  // The reports that start or stop a capture are not part of it
+  Capture& capture = _terminal->capture();
+  Report report;
+  while (_reports.pop(report)) {
+    const bool capturing = capture.active();
+    handle_report(report);
+    if (capturing && capture.active()) {
+      capture.keys(report._modifiers, report._keys);
+    }
+  }
 
-const string
-Keyboard::ToggleScreenSize::operator()(Keyboard* keyboard) const
-{
-  keyboard->terminal()->toggle_screen_size();
-  return "";
+  const unsigned dropped_reports = _dropped_reports;
+  if (dropped_reports != _dropped_reports_logged) {
+    log(LogWarning, "%u keyboard reports lost", dropped_reports - _dropped_reports_logged);
+    _dropped_reports_logged = dropped_reports;
+  }
 }
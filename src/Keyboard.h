@@ -2,11 +2,12 @@
 
 #pragma once
 
-#include <set>
-#include <map>
-#include <string>
+#include <bitset>
+
+#include <circle/timer.h>
 
 #include "Logging.h"
+#include "RingBuffer.h"
 
 using namespace std;
 
@@ -18,33 +19,53 @@ class Keyboard
 {
 public:
   Keyboard(Terminal* terminal);
+  ~Keyboard();
 
   Terminal* terminal() const { return _terminal; }
 
   void process();
 
+  // Reports that arrived while the queue was full
+  unsigned dropped_reports() const { return _dropped_reports; }
+
+  // A key that sends characters repeats after being held down for the
+  // delay, at the given rate in characters per second
+  void set_typematic(unsigned delay_milliseconds, unsigned characters_per_second);
+
+  // DECARM
+  void set_autorepeat(bool autorepeat);
+
+  // Handles a keyboard report that is played back from a capture
+  void replay_report(unsigned char modifiers, const unsigned char keys[6]);
+
 private:
-  struct KeyDefinition;
-  class KeypressHandler;
+  // Keyboard report as received by the USB interrupt handler, with the
+  // time of its arrival in microseconds
+  struct Report
+  {
+    unsigned _time;
+    unsigned char _modifiers;
+    unsigned char _keys[6];
+  };
+
+  static const size_t REPORT_QUEUE_SIZE = 64;
 
-  set<unsigned char> _keys_pressed;
+  bitset<256> _keys_pressed;
   bool _error;
-  map<unsigned char, KeyDefinition*> _map;
+  unsigned _dropped_reports_logged;
   Terminal* _terminal;
   CUSBKeyboardDevice* _usb_keyboard;
 
-  static unsigned char _modifiers;
-  static unsigned char _keys[6];
+  static RingBuffer<Report, REPORT_QUEUE_SIZE> _reports;
+  static volatile unsigned _dropped_reports;
 
   static Keyboard* _this;
 
-  void initialize_keymap();
-
   void key_pressed(unsigned char modifiers,
-                   unsigned char key_code);
+                   unsigned char key_code,
+                   unsigned time);
 
-  void handle_report(unsigned char modifiers,
-                     const unsigned char keys[6]);
+  void handle_report(const Report& report);
 
   friend void handle_report_stub(unsigned char modifiers,
                                  const unsigned char key_code[6]);
@@ -60,65 +81,68 @@ private:
                   RightMeta = 128
   };
 
-  struct KeyDefinition
-  {
-    KeyDefinition(const char* const name, KeypressHandler* solo, KeypressHandler* shift, KeypressHandler* control)
-      : _name(name), _solo(solo), _shift(shift), _control(control)
-    {}
-
-    const string _name;
-    KeypressHandler* _solo;
-    KeypressHandler* _shift;
-    KeypressHandler* _control;
-  };
-
-  class KeypressHandler
-  {
-  public:
-    virtual ~KeypressHandler() {};
-    virtual const string operator()(Keyboard* keyboard) const = 0;
-  };
-
-  class String
-    : public KeypressHandler
-  {
-  public:
-    String(const char* s) : _s(s) {}
-    virtual const string operator()(__unused Keyboard* keyboard) const { return _s; }
-
-    const string _s;
+  enum Action {
+    NoAction,
+    Send,
+    CycleSerialSpeed,
+    ToggleScreenSize,
+    CycleFlowControl,
+    ToggleCounters,
+    CycleColorScheme,
+    CycleBrightness,
+    ToggleCapture,
+    ReplayCapture,
+    ReplayCaptureFast
   };
 
-  class Char
-    : public KeypressHandler
+  // What happens when a key is pressed: a byte sequence that is sent to
+  // the host, or one of the local actions
+  struct KeyAction
   {
-  public:
-    Char(const unsigned char c) : _c(c) {}
-    virtual const string operator()(__unused Keyboard* keyboard) const { return string(1, _c); }
-
-    const unsigned char _c;
+    Action _action;
+    unsigned char _length;
+    const char* _sequence;
   };
 
-  class DeadKey
-    : public KeypressHandler
-  {
-  public:
-    virtual const string operator()(__unused Keyboard* keyboard) const { return ""; }
+  // Which mode selects the application column of a key
+  enum ApplicationMode {
+    NoApplicationMode,
+    ApplicationCursorKeys,
+    ApplicationKeypad
   };
 
-  static DeadKey dead_key;
-
-  class ToggleScreenSize
-    : public KeypressHandler
+  struct KeyDefinition
   {
-  public:
-    virtual const string operator()(Keyboard* keyboard) const;
+    const char* _name;
+    KeyAction _solo;
+    KeyAction _shift;
+    KeyAction _control;
+    KeyAction _application;
+    ApplicationMode _application_mode;
   };
 
-  class CycleSerialSpeed
-    : public KeypressHandler
-  {
-  public:
-    virtual const string operator()(Keyboard* keyboard) const;
-  };
+  // Indexed by USB key code, generated from tools/keymap.txt
+  static const KeyDefinition _keymap[256];
+
+  void perform(const KeyAction& action);
+
+  // Autorepeat is driven by a kernel timer so that its cadence does not
+  // depend on how long the main loop takes.  The timer handler only
+  // sends the action of the repeating key, which is resolved when the
+  // key is pressed.  Times are in microseconds.
+  CTimer* _timer;
+  unsigned _repeat_delay;
+  unsigned _repeat_interval;
+  bool _autorepeat;
+  unsigned char _repeat_key;
+  const KeyAction* _repeat_action;
+  unsigned _repeat_due;
+  TKernelTimerHandle _repeat_timer;
+
+  void start_repeat(unsigned char key_code, const KeyAction& action, unsigned time);
+  void stop_repeat();
+  void schedule_repeat();
+  void repeat();
+
+  static void repeat_handler(TKernelTimerHandle timer, void* param, void* context);
 };
@@ -14,7 +14,7 @@ LogWrite(const char* source, unsigned severity, const char* fmt, ...)
 }
 
 void
-Logging::log(TLogSeverity severity, const char* fmt, ...)
+Logging::write(TLogSeverity severity, const char* fmt, ...)
 {
   CLogger* logger = CLogger::Get();
   if (logger) {
@@ -25,3 +25,19 @@ Logging::log(TLogSeverity severity, const char* fmt, ...)
   }
 }
 
+#ifdef __clang__
+
+void
+Logging::log(TLogSeverity severity, const char* fmt, ...)
+{
+  CLogger* logger = CLogger::Get();
+  if (severity <= PIVT_LOG_LEVEL && logger) {
+    va_list vl;
+    va_start(vl, fmt);
+    logger->WriteV(_name.c_str(), severity, fmt, vl);
+    va_end(vl);
+  }
+}
+
+#endif
+
@@ -10,12 +10,38 @@
 
 using namespace std;
 
+// Log messages that are less severe than this are not compiled in.
+// Builds that need them can define it, e.g. -DPIVT_LOG_LEVEL=LogDebug.
+// The hot paths record trace events instead (see Trace.h).
+#ifndef PIVT_LOG_LEVEL
+#define PIVT_LOG_LEVEL LogNotice
+#endif
+
 class Logging
 {
 protected:
   Logging(const char* name) : _name(name) {}
 
-  void log(TLogSeverity severity, const char* fmt, ...);
+#ifndef __clang__
+  // The severity is known at each call, so the comparison is resolved
+  // when the call is inlined and disabled messages leave no code.  The
+  // arguments are passed on as they are, and the format is checked
+  // against them at the call.
+  __attribute__ ((always_inline, format (printf, 3, 4)))
+  void
+  log(TLogSeverity severity, const char* fmt, ...)
+  {
+    if (severity <= PIVT_LOG_LEVEL) {
+      write(severity, fmt, __builtin_va_arg_pack());
+    }
+  }
+#else
+  // clang cannot pass the arguments of an inlined function on, so the
+  // severity is compared at run time
+  void log(TLogSeverity severity, const char* fmt, ...) __attribute__ ((format (printf, 3, 4)));
+#endif
+
+  void write(TLogSeverity severity, const char* fmt, ...) __attribute__ ((format (printf, 3, 4)));
 
 private:
   string _name;
@@ -0,0 +1,81 @@
+// -*- C++ -*-
+
+#pragma once
+
+// Stage timing and throughput counters for the host benchmark (make
+// host-bench).  Only the host build defines PIVT_HOST, so on the device
+// the macros below compile to nothing.
+
+#ifdef PIVT_HOST
+
+#include <chrono>
+#include <cstdint>
+
+struct Profile
+{
+  // Time spent in a nested stage is only counted for that stage, so
+  // Blit is not included in the Parse or Render time that it happens
+  // in.
+  enum Stage {
+    Parse,
+    Render,
+    Blit,
+    Stages
+  };
+
+  static uint64_t _nanoseconds[Stages];
+  static uint64_t _bytes_received;
+  static uint64_t _cells_rendered;
+  static uint64_t _cells_skipped;
+  static uint64_t _frames_rendered;
+  static uint64_t _moves_skipped;
+
+  static void reset();
+};
+
+class ProfileScope
+{
+public:
+  ProfileScope(Profile::Stage stage)
+    : _stage(stage),
+      _outer(_current)
+  {
+    if (_outer) {
+      _outer->stop();
+    }
+    _current = this;
+    _start = std::chrono::steady_clock::now();
+  }
+
+  ~ProfileScope()
+  {
+    stop();
+    _current = _outer;
+    if (_outer) {
+      _outer->_start = std::chrono::steady_clock::now();
+    }
+  }
+
+private:
+  Profile::Stage _stage;
+  ProfileScope* _outer;
+  std::chrono::steady_clock::time_point _start;
+
+  static ProfileScope* _current;
+
+  void stop()
+  {
+    Profile::_nanoseconds[_stage]
+      += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count();
+  }
+};
+
+#define PROFILE_STAGE(stage) ProfileScope profile_scope_(Profile::stage)
+#define PROFILE_COUNT(counter, n) (Profile::_##counter += (n))
+
+#else
+
+#define PROFILE_STAGE(stage)
+#define PROFILE_COUNT(counter, n)
+
+#endif
@@ -0,0 +1,167 @@
+#include <cstring>
+
+#include "Replay.h"
+#include "Keyboard.h"
+
+using namespace std;
+
+Replay::Replay()
+  : Logging("Replay"),
+    _file(nullptr),
+    _timer(CTimer::Get()),
+    _original_speed(false),
+    _due(0),
+    _header(false),
+    _type(Capture::Data),
+    _data_left(0),
+    _start(0),
+    _end(0)
+{
+}
+
+Replay::~Replay()
+{
+  stop();
+}
+
+bool
+Replay::start(const char* filename, bool original_speed)
+{
+  stop();
+
+  _file = fopen(filename, "rb");
+  if (!_file) {
+    log(LogError, "Cannot open %s", filename);
+    return false;
+  }
+
+  _original_speed = original_speed;
+  _due = _timer->GetClockTicks();
+  _header = false;
+  _data_left = 0;
+  _start = _end = 0;
+  if (!fill(sizeof Capture::MAGIC) || memcmp(_buffer, Capture::MAGIC, sizeof Capture::MAGIC) != 0) {
+    log(LogError, "%s is not a capture", filename);
+    stop();
+    return false;
+  }
+  _start += sizeof Capture::MAGIC;
+
+  log(LogNotice, "Replaying %s at %s speed", filename, original_speed ? "original" : "maximum");
+  return true;
+}
+
+void
+Replay::stop()
+{
+  if (_file) {
+    fclose(_file);
+    _file = nullptr;
+    log(LogNotice, "Replay stopped");
+  }
+}
+
+bool
+Replay::available()
+{
+  if (!_file) {
+    return false;
+  }
+  if (!_header && !read_header()) {
+    stop();
+    return false;
+  }
+  return !_original_speed || (int) (_timer->GetClockTicks() - _due) >= 0;
+}
+
+size_t
+Replay::read(char* buffer, size_t size, Keyboard* keyboard)
+{
+  size_t length = 0;
+  while (length < size && available()) {
+    if (_type == Capture::Keys) {
+      // Keys that follow received bytes are handled after them
+      if (length) {
+        break;
+      }
+      if (!fill(KEYS_SIZE)) {
+        log(LogError, "Truncated keyboard report");
+        stop();
+        break;
+      }
+      keyboard->replay_report(_buffer[_start], &_buffer[_start + 1]);
+      _start += KEYS_SIZE;
+      _header = false;
+      continue;
+    }
+
+    if (_data_left && !fill(1)) {
+      log(LogError, "Truncated data");
+      stop();
+      break;
+    }
+    const size_t n = min(min(size - length, _data_left), _end - _start);
+    memcpy(buffer + length, &_buffer[_start], n);
+    _start += n;
+    _data_left -= n;
+    length += n;
+    if (!_data_left) {
+      _header = false;
+    }
+  }
+  return length;
+}
+
+// Makes sure that count bytes are buffered.  Returns false at the end
+// of the file.
+bool
+Replay::fill(size_t count)
+{
+  if (_end - _start >= count) {
+    return true;
+  }
+  memmove(_buffer, &_buffer[_start], _end - _start);
+  _end -= _start;
+  _start = 0;
+  _end += fread(&_buffer[_end], 1, BUFFER_SIZE - _end, _file);
+  return _end - _start >= count;
+}
+
+bool
+Replay::decode(uint32_t& value)
+{
+  value = 0;
+  for (unsigned i = 0; i < Capture::MAX_NUMBER_BYTES; i++) {
+    if (!fill(1)) {
+      return false;
+    }
+    const uint8_t byte = _buffer[_start++];
+    value |= uint32_t(byte & 0x7f) << (7 * i);
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns false at the end of the file or of a valid capture
+bool
+Replay::read_header()
+{
+  if (!fill(1)) {
+    return false;
+  }
+  _type = static_cast<Capture::RecordType>(_buffer[_start++]);
+  uint32_t delta;
+  uint32_t length = 0;
+  if ((_type != Capture::Data && _type != Capture::Keys)
+      || !decode(delta)
+      || (_type == Capture::Data && !decode(length))) {
+    log(LogError, "Invalid record");
+    return false;
+  }
+  _due += delta;
+  _data_left = length;
+  _header = true;
+  return true;
+}
@@ -0,0 +1,61 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+#include <circle/timer.h>
+
+#include "Capture.h"
+#include "Logging.h"
+
+using namespace std;
+
+class Keyboard;
+
+// Plays back a session that was recorded by Capture, either with the
+// time differences of the recording or as fast as the terminal can take
+// it.  When the terminal falls behind the original timing, the records
+// are played back as soon as possible until it has caught up.
+class Replay
+  : protected Logging
+{
+public:
+  Replay();
+  ~Replay();
+
+  bool start(const char* filename, bool original_speed);
+  void stop();
+  bool active() const { return _file != nullptr; }
+
+  // Whether a record is due.  The replay stops at the end of the file.
+  bool available();
+
+  // Reads received bytes that are due into buffer and returns their
+  // number.  Keyboard reports that are due before them are handed to
+  // the keyboard.
+  size_t read(char* buffer, size_t size, Keyboard* keyboard);
+
+private:
+  static const size_t BUFFER_SIZE = 4096;
+  static const size_t KEYS_SIZE = 7;
+
+  FILE* _file;
+  CTimer* _timer;
+  bool _original_speed;
+  // When the record whose header has been read is due
+  unsigned _due;
+
+  bool _header;
+  Capture::RecordType _type;
+  size_t _data_left;
+
+  uint8_t _buffer[BUFFER_SIZE];
+  size_t _start;
+  size_t _end;
+
+  bool fill(size_t count);
+  bool decode(uint32_t& value);
+  bool read_header();
+};
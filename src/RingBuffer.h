@@ -0,0 +1,78 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+using namespace std;
+
+// Ring buffer for one producer and one consumer, which may run in
+// interrupt context.  The size must be a power of two.  The indices
+// count up and wrap around freely, so the ring can be filled
+// completely.
+template <typename T, size_t Size>
+class RingBuffer
+{
+  static_assert((Size & (Size - 1)) == 0, "RingBuffer size must be a power of two");
+
+public:
+  RingBuffer() : _head(0), _tail(0) {}
+
+  static constexpr size_t capacity() { return Size; }
+
+  size_t size() const { return _head.load(memory_order_acquire) - _tail.load(memory_order_acquire); }
+  size_t free() const { return Size - size(); }
+  bool empty() const { return size() == 0; }
+
+  // Producer side
+  bool
+  push(const T& value)
+  {
+    const size_t head = _head.load(memory_order_relaxed);
+    if (head - _tail.load(memory_order_acquire) == Size) {
+      return false;
+    }
+    _buffer[head & (Size - 1)] = value;
+    _head.store(head + 1, memory_order_release);
+    return true;
+  }
+
+  // Consumer side
+  bool
+  pop(T& value)
+  {
+    const size_t tail = _tail.load(memory_order_relaxed);
+    if (_head.load(memory_order_acquire) == tail) {
+      return false;
+    }
+    value = _buffer[tail & (Size - 1)];
+    _tail.store(tail + 1, memory_order_release);
+    return true;
+  }
+
+  // Consumer side, removes up to count elements and returns how many
+  // were removed
+  size_t
+  pop(T* values, size_t count)
+  {
+    const size_t tail = _tail.load(memory_order_relaxed);
+    const size_t available = _head.load(memory_order_acquire) - tail;
+    if (count > available) {
+      count = available;
+    }
+    for (size_t i = 0; i < count; i++) {
+      values[i] = _buffer[(tail + i) & (Size - 1)];
+    }
+    _tail.store(tail + count, memory_order_release);
+    return count;
+  }
+
+  // Consumer side, the oldest element
+  const T& front() const { return _buffer[_tail.load(memory_order_relaxed) & (Size - 1)]; }
+
+private:
+  T _buffer[Size];
+  atomic<size_t> _head;
+  atomic<size_t> _tail;
+};
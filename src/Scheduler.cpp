@@ -0,0 +1,71 @@
+
+#include "Scheduler.h"
+
+using namespace std;
+
+Scheduler::Scheduler(CTimer* timer)
+  : _timer(timer),
+    _pending(false),
+    _next_due(0)
+{
+}
+
+void
+Scheduler::add(Event& event)
+{
+  _events.push_back(&event);
+}
+
+void
+Scheduler::schedule(Event& event, unsigned due)
+{
+  event._due = due;
+  event._pending = true;
+  if (!_pending || before(due, _next_due)) {
+    _pending = true;
+    _next_due = due;
+  } else if (due != _next_due) {
+    update_next_due();
+  }
+}
+
+void
+Scheduler::cancel(Event& event)
+{
+  if (event._pending) {
+    event._pending = false;
+    update_next_due();
+  }
+}
+
+void
+Scheduler::run()
+{
+  if (!_pending) {
+    return;
+  }
+  const unsigned now = _timer->GetClockTicks();
+  if (before(now, _next_due)) {
+    return;
+  }
+
+  for (Event* event : _events) {
+    if (event->_pending && !before(now, event->_due)) {
+      event->_pending = false;
+      (*event->_handler)(event->_context);
+    }
+  }
+  update_next_due();
+}
+
+void
+Scheduler::update_next_due()
+{
+  _pending = false;
+  for (const Event* event : _events) {
+    if (event->_pending && (!_pending || before(event->_due, _next_due))) {
+      _pending = true;
+      _next_due = event->_due;
+    }
+  }
+}
@@ -0,0 +1,65 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <vector>
+
+#include <circle/timer.h>
+
+using namespace std;
+
+// Calls handlers at given times from the main loop.  Only the time of
+// the earliest pending event is compared with the clock, so passes of
+// the main loop in which nothing is due cost next to nothing.  Times
+// are in microseconds of CTimer::GetClockTicks() and may wrap around.
+class Scheduler
+{
+public:
+  typedef void Handler(void* context);
+
+  class Event
+  {
+  public:
+    Event(Handler* handler, void* context)
+      : _handler(handler),
+        _context(context),
+        _due(0),
+        _pending(false)
+    {}
+
+  private:
+    Handler* _handler;
+    void* _context;
+    unsigned _due;
+    bool _pending;
+
+    friend class Scheduler;
+  };
+
+  Scheduler(CTimer* timer);
+
+  // Events must be added before they are scheduled and stay valid
+  // while the scheduler is used.
+  void add(Event& event);
+
+  // Replaces an earlier time if the event is already pending
+  void schedule(Event& event, unsigned due);
+  void cancel(Event& event);
+  static bool pending(const Event& event) { return event._pending; }
+
+  unsigned now() const { return _timer->GetClockTicks(); }
+
+  // Calls the handlers of the events that are due.  A handler may
+  // schedule its event again.
+  void run();
+
+private:
+  CTimer* _timer;
+  vector<Event*> _events;
+  bool _pending;
+  unsigned _next_due;
+
+  static bool before(unsigned a, unsigned b) { return static_cast<int>(a - b) < 0; }
+
+  void update_next_due();
+};
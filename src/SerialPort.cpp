@@ -0,0 +1,420 @@
+
+#include <cstring>
+
+#include <circle/devicenameservice.h>
+#include <circle/synchronize.h>
+#include <circle/timer.h>
+
+#ifndef PIVT_HOST
+#include <circle/bcm2835.h>
+#include <circle/gpiopin.h>
+#include <circle/interrupt.h>
+#include <circle/machineinfo.h>
+#include <circle/memio.h>
+#endif
+
+#include "SerialPort.h"
+
+using namespace std;
+
+#ifndef PIVT_HOST
+
+#define DR_FE                   (1 << 8)
+#define DR_PE                   (1 << 9)
+#define DR_BE                   (1 << 10)
+#define DR_OE                   (1 << 11)
+
+#define FR_BUSY                 (1 << 3)
+#define FR_RXFE                 (1 << 4)
+#define FR_TXFF                 (1 << 5)
+
+#define LCRH_FEN                (1 << 4)
+#define LCRH_WLEN8              (3 << 5)
+
+#define CR_UARTEN               (1 << 0)
+#define CR_TXE                  (1 << 8)
+#define CR_RXE                  (1 << 9)
+#define CR_RTS                  (1 << 11)
+#define CR_CTSEN                (1 << 15)
+
+#define IFLS_RX_HALF            (2 << 3)
+#define IFLS_TX_EIGHTH          (0 << 0)
+
+#define INT_RX                  (1 << 4)
+#define INT_TX                  (1 << 5)
+#define INT_RT                  (1 << 6)
+#define INT_ALL                 0x7ff
+
+#define TX_FIFO_SIZE            16
+
+#define GPIO_TXD                14
+#define GPIO_RXD                15
+#define GPIO_CTS                16
+#define GPIO_RTS                17
+
+#endif
+
+SerialPort::SerialPort(CInterruptSystem* interrupt_system)
+  : Logging("SerialPort"),
+    _interrupt_system(interrupt_system),
+    _interrupt_connected(false),
+    _speed(0),
+    _flow_control(None),
+    _high_watermark(RECEIVE_BUFFER_SIZE * 3 / 4),
+    _low_watermark(RECEIVE_BUFFER_SIZE / 4),
+    _throttled(false),
+    _pending_flow_character(0),
+    _transmit_stopped(false),
+    _counters {}
+#ifdef PIVT_HOST
+    , _feed_data(nullptr),
+    _feed_length(0),
+    _bytes_written(0)
+#endif
+{
+}
+
+SerialPort::~SerialPort()
+{
+#ifndef PIVT_HOST
+  write32(ARM_UART0_IMSC, 0);
+  write32(ARM_UART0_CR, 0);
+  if (_interrupt_connected) {
+    _interrupt_system->DisconnectIRQ(ARM_IRQ_UART);
+  }
+#endif
+}
+
+const char*
+SerialPort::flow_control_name(FlowControl flow_control)
+{
+  switch (flow_control) {
+  case None:
+    return "none";
+  case Hardware:
+    return "RTS/CTS";
+  case XonXoff:
+    return "XON/XOFF";
+  }
+  return "unknown";
+}
+
+void
+SerialPort::set_watermarks(size_t high, size_t low)
+{
+  _high_watermark = min(high, RECEIVE_BUFFER_SIZE);
+  _low_watermark = min(low, _high_watermark);
+}
+
+size_t
+SerialPort::available() const
+{
+#ifdef PIVT_HOST
+  return _receive_buffer.size() + _feed_length;
+#else
+  return _receive_buffer.size();
+#endif
+}
+
+// Called by the interrupt handler for each byte received
+void
+SerialPort::receive(char c)
+{
+  if (_flow_control == XonXoff && (c == XON || c == XOFF)) {
+    _transmit_stopped = (c == XOFF);
+    return;
+  }
+
+  _counters._received++;
+  if (!_receive_buffer.push(c)) {
+    _counters._overruns++;
+  }
+
+  if (!_throttled && _flow_control != None && _receive_buffer.size() > _high_watermark) {
+    throttle();
+  }
+}
+
+size_t
+SerialPort::read(void* buffer, size_t count)
+{
+#ifdef PIVT_HOST
+  while (_feed_length && !_throttled) {
+    receive(*_feed_data++);
+    _feed_length--;
+  }
+#endif
+
+  count = _receive_buffer.pop(static_cast<char*>(buffer), count);
+
+  if (_throttled && _receive_buffer.size() <= _low_watermark) {
+    EnterCritical();
+    if (_throttled) {
+      release();
+    }
+    LeaveCritical();
+  }
+
+  return count;
+}
+
+#ifdef PIVT_HOST
+
+bool
+SerialPort::initialize(unsigned speed)
+{
+  _speed = speed;
+  CDeviceNameService::Get()->AddDevice("ttyS1", this, FALSE);
+  return true;
+}
+
+void
+SerialPort::set_speed(unsigned speed)
+{
+  _speed = speed;
+}
+
+void
+SerialPort::set_flow_control(FlowControl flow_control)
+{
+  if (_throttled) {
+    release();
+  }
+  _flow_control = flow_control;
+  _transmit_stopped = false;
+}
+
+void
+SerialPort::throttle()
+{
+  _throttled = true;
+  _counters._throttles++;
+  if (_flow_control == XonXoff) {
+    _bytes_written++;
+  }
+}
+
+void
+SerialPort::release()
+{
+  _throttled = false;
+  if (_flow_control == XonXoff) {
+    _bytes_written++;
+  }
+}
+
+size_t
+SerialPort::write(__unused const void* buffer, size_t count)
+{
+  _bytes_written += count;
+  return count;
+}
+
+void
+SerialPort::feed(const char* data, size_t length)
+{
+  _feed_data = data;
+  _feed_length = length;
+}
+
+#else
+
+bool
+SerialPort::initialize(unsigned speed)
+{
+  static CGPIOPin txd_pin(GPIO_TXD, GPIOModeAlternateFunction0);
+  static CGPIOPin rxd_pin(GPIO_RXD, GPIOModeAlternateFunction0);
+  static CGPIOPin cts_pin(GPIO_CTS, GPIOModeAlternateFunction3);
+  static CGPIOPin rts_pin(GPIO_RTS, GPIOModeAlternateFunction3);
+  rxd_pin.SetPullMode(GPIOPullModeUp);
+  // CTS is active low, so that an unconnected pin does not stop the
+  // transmitter.
+  cts_pin.SetPullMode(GPIOPullModeDown);
+
+  write32(ARM_UART0_IMSC, 0);
+  write32(ARM_UART0_ICR, INT_ALL);
+
+  _interrupt_system->ConnectIRQ(ARM_IRQ_UART, interrupt_stub, this);
+  _interrupt_connected = true;
+
+  set_speed(speed);
+
+  write32(ARM_UART0_IFLS, IFLS_RX_HALF | IFLS_TX_EIGHTH);
+  write32(ARM_UART0_IMSC, INT_RX | INT_RT);
+
+  CDeviceNameService::Get()->AddDevice("ttyS1", this, FALSE);
+
+  set_flow_control(_flow_control);
+
+  return true;
+}
+
+void
+SerialPort::set_speed(unsigned speed)
+{
+  // The divisor has six fractional bits
+  const unsigned clock_rate = CMachineInfo::Get()->GetClockRate(CLOCK_ID_UART);
+  const unsigned divisor = (clock_rate * 4 + speed / 2) / speed;
+
+  // Let the transmitter send what is in its FIFO at the old speed, but
+  // not for longer than that takes, as CTS may be holding it.
+  if (_speed) {
+    CTimer* timer = CTimer::Get();
+    const unsigned start = timer->GetClockTicks();
+    const unsigned timeout = (TX_FIFO_SIZE + 1) * 10 * 1000000 / _speed;
+    while ((read32(ARM_UART0_FR) & FR_BUSY)
+           && timer->GetClockTicks() - start < timeout) {
+    }
+  }
+
+  EnterCritical();
+  const u32 control = read32(ARM_UART0_CR);
+  write32(ARM_UART0_CR, 0);
+  write32(ARM_UART0_IBRD, divisor >> 6);
+  write32(ARM_UART0_FBRD, divisor & 0x3f);
+  write32(ARM_UART0_LCRH, LCRH_WLEN8 | LCRH_FEN);
+  write32(ARM_UART0_CR, (control & (CR_RTS | CR_CTSEN)) | CR_UARTEN | CR_TXE | CR_RXE);
+  LeaveCritical();
+
+  _speed = speed;
+}
+
+void
+SerialPort::set_flow_control(FlowControl flow_control)
+{
+  EnterCritical();
+  if (_throttled) {
+    release();
+  }
+  _flow_control = flow_control;
+  _transmit_stopped = false;
+
+  u32 control = read32(ARM_UART0_CR) & ~(CR_RTS | CR_CTSEN);
+  if (flow_control == Hardware) {
+    control |= CR_RTS | CR_CTSEN;
+  }
+  write32(ARM_UART0_CR, control);
+
+  start_transmitter();
+  LeaveCritical();
+}
+
+void
+SerialPort::set_rts(bool asserted)
+{
+  const u32 control = read32(ARM_UART0_CR);
+  write32(ARM_UART0_CR, asserted ? (control | CR_RTS) : (control & ~CR_RTS));
+}
+
+// Called with interrupts disabled
+void
+SerialPort::throttle()
+{
+  _throttled = true;
+  _counters._throttles++;
+  if (_flow_control == Hardware) {
+    set_rts(false);
+  } else if (_flow_control == XonXoff) {
+    _pending_flow_character = XOFF;
+    start_transmitter();
+  }
+}
+
+// Called with interrupts disabled
+void
+SerialPort::release()
+{
+  _throttled = false;
+  if (_flow_control == Hardware) {
+    set_rts(true);
+  } else if (_flow_control == XonXoff) {
+    _pending_flow_character = XON;
+    start_transmitter();
+  }
+}
+
+// Fills the transmit FIFO and enables the transmit interrupt while
+// there is more to send.  Called with interrupts disabled.
+void
+SerialPort::start_transmitter()
+{
+  while (!(read32(ARM_UART0_FR) & FR_TXFF)) {
+    char c;
+    if (_pending_flow_character) {
+      write32(ARM_UART0_DR, _pending_flow_character);
+      _pending_flow_character = 0;
+    } else if (!_transmit_stopped && _transmit_buffer.pop(c)) {
+      write32(ARM_UART0_DR, static_cast<u8>(c));
+    } else {
+      break;
+    }
+  }
+
+  const u32 mask = read32(ARM_UART0_IMSC);
+  if (_pending_flow_character || (!_transmit_stopped && !_transmit_buffer.empty())) {
+    write32(ARM_UART0_IMSC, mask | INT_TX);
+  } else {
+    write32(ARM_UART0_IMSC, mask & ~INT_TX);
+  }
+}
+
+size_t
+SerialPort::write(const void* buffer, size_t count)
+{
+  const char* p = static_cast<const char*>(buffer);
+  size_t written = 0;
+
+  // Keyboard autorepeat writes from the timer interrupt
+  EnterCritical();
+  while (written < count && _transmit_buffer.push(p[written])) {
+    written++;
+  }
+  _counters._transmit_drops += count - written;
+  start_transmitter();
+  LeaveCritical();
+
+  return count;
+}
+
+void
+SerialPort::interrupt_handler()
+{
+  const u32 status = read32(ARM_UART0_MIS);
+  write32(ARM_UART0_ICR, status);
+
+  if (status & (INT_RX | INT_RT)) {
+    const bool transmit_stopped = _transmit_stopped;
+    while (!(read32(ARM_UART0_FR) & FR_RXFE)) {
+      const u32 data = read32(ARM_UART0_DR);
+      if (data & DR_OE) {
+        _counters._hardware_overruns++;
+      }
+      if (data & DR_BE) {
+        _counters._breaks++;
+        continue;
+      }
+      if (data & DR_FE) {
+        _counters._framing_errors++;
+      }
+      if (data & DR_PE) {
+        _counters._parity_errors++;
+      }
+      receive(data & 0xff);
+    }
+    if (transmit_stopped && !_transmit_stopped) {
+      start_transmitter();
+    }
+  }
+
+  if (status & INT_TX) {
+    start_transmitter();
+  }
+}
+
+void
+SerialPort::interrupt_stub(void* param)
+{
+  static_cast<SerialPort*>(param)->interrupt_handler();
+}
+
+#endif
@@ -0,0 +1,123 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <circle/device.h>
+#include <circle/types.h>
+
+#include "Logging.h"
+#include "RingBuffer.h"
+
+class CInterruptSystem;
+
+// Interrupt driven driver for the PL011 UART.
+//
+// Received bytes are put into a large ring buffer by the interrupt
+// handler so that nothing is lost while the main loop is busy
+// rendering.  When the ring fills up beyond the high watermark, the
+// sender is throttled by dropping RTS or by sending XOFF, and it is
+// released again when the terminal has read the ring down to the low
+// watermark.
+//
+// The port registers itself as ttyS1 so that it can be used as the
+// log device.
+class SerialPort
+  : public CDevice,
+    protected Logging
+{
+public:
+  enum FlowControl {
+    None,
+    Hardware,
+    XonXoff
+  };
+
+  // Bytes and errors seen since the port was initialized
+  struct Counters
+  {
+    unsigned _received;
+    unsigned _overruns;                 // ring buffer was full
+    unsigned _hardware_overruns;        // receive FIFO was full
+    unsigned _framing_errors;
+    unsigned _parity_errors;
+    unsigned _breaks;
+    unsigned _throttles;
+    unsigned _transmit_drops;
+  };
+
+  static const size_t RECEIVE_BUFFER_SIZE = 16384;
+  static const size_t TRANSMIT_BUFFER_SIZE = 2048;
+
+  SerialPort(CInterruptSystem* interrupt_system);
+  ~SerialPort();
+
+  bool initialize(unsigned speed);
+
+  void set_speed(unsigned speed);
+  unsigned speed() const { return _speed; }
+
+  void set_flow_control(FlowControl flow_control);
+  FlowControl flow_control() const { return _flow_control; }
+  static const char* flow_control_name(FlowControl flow_control);
+
+  // The sender is throttled when more than high bytes are buffered
+  // and released when no more than low bytes are left.
+  void set_watermarks(size_t high, size_t low);
+
+  // Returns the number of bytes read, never blocks
+  size_t read(void* buffer, size_t count);
+  size_t write(const void* buffer, size_t count);
+
+  size_t available() const;
+  bool throttled() const { return _throttled; }
+  const Counters& counters() const { return _counters; }
+
+  // CDevice
+  int Write(const void* buffer, size_t count) override { return write(buffer, count); }
+
+#ifdef PIVT_HOST
+  // Makes data available for reading as if it had been received.  The
+  // buffer is not copied.  Like a sender that obeys flow control, the
+  // data is only moved into the ring while the port is not throttled.
+  void feed(const char* data, size_t length);
+  size_t bytes_written() const { return _bytes_written; }
+#endif
+
+private:
+  static const char XON = 0x11;
+  static const char XOFF = 0x13;
+
+  CInterruptSystem* _interrupt_system;
+  bool _interrupt_connected;
+  unsigned _speed;
+  FlowControl _flow_control;
+  size_t _high_watermark;
+  size_t _low_watermark;
+
+  RingBuffer<char, RECEIVE_BUFFER_SIZE> _receive_buffer;
+  RingBuffer<char, TRANSMIT_BUFFER_SIZE> _transmit_buffer;
+
+  // Set by the interrupt handler, cleared by read()
+  volatile bool _throttled;
+  // Flow control character to be sent ahead of the transmit buffer
+  volatile char _pending_flow_character;
+  // The other end has sent XOFF
+  volatile bool _transmit_stopped;
+
+  Counters _counters;
+
+  void receive(char c);
+  void throttle();
+  void release();
+
+#ifdef PIVT_HOST
+  const char* _feed_data;
+  size_t _feed_length;
+  size_t _bytes_written;
+#else
+  void set_rts(bool asserted);
+  void start_transmitter();
+  void interrupt_handler();
+  static void interrupt_stub(void* param);
+#endif
+};
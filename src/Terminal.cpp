@@ -3,10 +3,13 @@
 #include <sstream>
 #include <vector>
 
-#include <circle/serial.h>
 #include <circle/devicenameservice.h>
 
 #include "Terminal.h"
+#include "Counters.h"
+#include "Profile.h"
+#include "Trace.h"
+#include "UnicodeMap.h"
 
 static int
 term_damage(VTermRect rect, void* terminal)
@@ -26,175 +29,926 @@ term_moverect(VTermRect dest, VTermRect src, void* terminal)
   return reinterpret_cast<Terminal*>(terminal)->moverect(dest, src);
 }
 
+static int
+term_settermprop(VTermProp prop, VTermValue* value, void* terminal)
+{
+  return reinterpret_cast<Terminal*>(terminal)->settermprop(prop, value);
+}
+
+static int
+term_bell(void* terminal)
+{
+  return reinterpret_cast<Terminal*>(terminal)->bell();
+}
+
+static int
+term_putglyph(VTermGlyphInfo* info, VTermPos position, void* terminal)
+{
+  return reinterpret_cast<Terminal*>(terminal)->putglyph(info, position);
+}
+
+static int
+term_erase(VTermRect rect, int selective, void* terminal)
+{
+  return reinterpret_cast<Terminal*>(terminal)->erase(rect, selective);
+}
+
+static int
+term_initpen(void* terminal)
+{
+  return reinterpret_cast<Terminal*>(terminal)->initpen();
+}
+
+static int
+term_setpenattr(VTermAttr attribute, VTermValue* value, void* terminal)
+{
+  return reinterpret_cast<Terminal*>(terminal)->setpenattr(attribute, value);
+}
+
+static int
+term_setlineinfo(int row, const VTermLineInfo* new_info, const VTermLineInfo* old_info, void* terminal)
+{
+  return reinterpret_cast<Terminal*>(terminal)->setlineinfo(row, new_info, old_info);
+}
+
 static void
 term_output(const char* bytes, size_t length, void* terminal)
 {
-  return reinterpret_cast<Terminal*>(terminal)->uart_write(bytes, length);
+  return reinterpret_cast<Terminal*>(terminal)->output(bytes, length);
 }
 
-Terminal::Terminal(CSerialDevice* serial_port)
+static const unsigned DEFAULT_FRAME_RATE = 60;
+// Trace records that are written per pass of an idle main loop, so
+// that input arriving meanwhile is not delayed for long
+static const unsigned TRACE_DRAIN_RECORDS = 16;
+// Time for which the capture is written per pass of an idle main loop.
+// A block that has been started is finished.
+static const unsigned CAPTURE_DRAIN_MICROSECONDS = 2000;
+// While input keeps arriving, the counters that are shown on the screen
+// are updated with this interval
+static const unsigned COUNTERS_INTERVAL = 500000;
+// The cursor is shown for this time and then hidden for as long
+static const unsigned CURSOR_BLINK_INTERVAL = 750000;
+// Blinking text is shown for this time and then hidden for as long
+static const unsigned TEXT_BLINK_INTERVAL = 500000;
+// Unchanged cells between changed ones that are rendered again rather
+// than starting another transfer
+static const unsigned MERGE_GAP = 4;
+// Runs of cells in one color that are filled rather than rendered
+static const unsigned FILL_CELLS = 8;
+// The file on the SD card that sessions are captured to
+static const char* const CAPTURE_FILE = "session.cap";
+
+Terminal::Terminal(SerialPort* serial_port, Layer layer)
   : Logging("Terminal"),
     _serial_port(serial_port),
-    _serial_speed(38400)
+    _serial_speed(38400),
+    _serial_counters(serial_port->counters()),
+    _timer(CTimer::Get()),
+    _frame_interval(1000000 / DEFAULT_FRAME_RATE),
+    _last_frame(_timer->GetClockTicks()),
+    _show_counters(false),
+    _counters_shown(0),
+    _probe(nullptr),
+    _layer(layer),
+    _screen(nullptr),
+    _state(nullptr),
+    _alternate_screen(false),
+    _pen {},
+    _damaged(false),
+    _cursor { 0, 0 },
+    _cursor_visible(true),
+    _cursor_on(true),
+    _cursor_moved(0),
+    _cursor_event(blink_cursor_stub, this),
+    _blinking_cells(0),
+    _blink_on(true),
+    _blink_event(blink_text_stub, this),
+    _scan_state(Ground),
+    _scan_private(false),
+    _scan_autorepeat(false),
+    _scan_parameter(0)
 {
   _framebuffer = make_shared<Framebuffer>();
   _keyboard = make_shared<Keyboard>(this);
 
-  unsigned rows = _framebuffer->height() / _framebuffer->font_height();
-  unsigned columns = _framebuffer->width() / _framebuffer->font_width();
+  _rows = _framebuffer->height() / _framebuffer->font_height();
+  _columns = _framebuffer->width() / _framebuffer->font_width();
 
-  log(LogDebug, "Got %u rows %u columns", rows, columns);
+  log(LogDebug, "Got %u rows %u columns", _rows, _columns);
 
-  _term = vterm_new(rows, columns);
+  _dirty.resize(_rows, DirtySpan { 0, 0 });
+  _shown_chars.resize(_rows * _columns);
+  _shown_attributes.resize(_rows * _columns, SHOWN_UNKNOWN);
+  _span_cell_attributes.resize(_columns);
+  _span_chars.resize(_columns);
+  _shown_colors.resize(_rows * _columns);
+  _span_attributes.resize(_columns);
+  _span_colors.resize(_columns);
+  _moved_chars.resize(_rows * _columns);
+  _moved_attributes.resize(_rows * _columns);
+  _moved_colors.resize(_rows * _columns);
+  _blinking.resize(_rows);
+  _framebuffer->scheduler().add(_cursor_event);
+  _framebuffer->scheduler().add(_blink_event);
+
+  _term = vterm_new(_rows, _columns);
 
   vterm_output_set_callback(_term, term_output, this);
 
-  _screen = vterm_obtain_screen(_term);
+  // The pen is kept as palette indices, which needs the default colors
+  // before the state layer is reset.
+  VTermColor default_foreground;
+  VTermColor default_background;
+  vterm_state_get_default_colors(vterm_obtain_state(_term), &default_foreground, &default_background);
+  _framebuffer->set_default_colors(default_foreground, default_background);
+
+  if (_layer == Layer::State) {
+    _state = vterm_obtain_state(_term);
+    initpen();
+    _cells.resize(_rows * _columns, _pen);
+    _alternate_cells.resize(_rows * _columns, _pen);
 
-  memset(&_callbacks, 0, sizeof _callbacks);
-  _callbacks.damage = term_damage;
-  _callbacks.movecursor = term_movecursor;
-  _callbacks.moverect = term_moverect;
+    // Without a scrollrect callback, libvterm scrolls by calling
+    // moverect and erase.
+    memset(&_state_callbacks, 0, sizeof _state_callbacks);
+    _state_callbacks.putglyph = term_putglyph;
+    _state_callbacks.movecursor = term_movecursor;
+    _state_callbacks.moverect = term_moverect;
+    _state_callbacks.erase = term_erase;
+    _state_callbacks.initpen = term_initpen;
+    _state_callbacks.setpenattr = term_setpenattr;
+    _state_callbacks.settermprop = term_settermprop;
+    _state_callbacks.bell = term_bell;
+    _state_callbacks.setlineinfo = term_setlineinfo;
 
-  vterm_screen_set_callbacks(_screen, &_callbacks, this);
-  vterm_screen_enable_altscreen(_screen, 1);
-  vterm_screen_reset(_screen, 1);
+    vterm_state_set_callbacks(_state, &_state_callbacks, this);
+    vterm_state_reset(_state, 1);
+  } else {
+    _screen = vterm_obtain_screen(_term);
+
+    memset(&_callbacks, 0, sizeof _callbacks);
+    _callbacks.damage = term_damage;
+    _callbacks.movecursor = term_movecursor;
+    _callbacks.moverect = term_moverect;
+    _callbacks.settermprop = term_settermprop;
+    _callbacks.bell = term_bell;
+
+    vterm_screen_set_callbacks(_screen, &_callbacks, this);
+    vterm_screen_enable_altscreen(_screen, 1);
+    vterm_screen_reset(_screen, 1);
+  }
 
   uart_set_speed(_serial_speed);
 }
 
+void
+Terminal::mark_dirty(int row, int start_column, int end_column)
+{
+  DirtySpan& span = _dirty[row];
+  if (span._start == span._end) {
+    span._start = start_column;
+    span._end = end_column;
+  } else {
+    span._start = min<unsigned short>(span._start, start_column);
+    span._end = max<unsigned short>(span._end, end_column);
+  }
+  _damaged = true;
+}
+
+// The shadow grid follows the pixels.  The cells that are left behind
+// are either unchanged or cleared, depending on how the frame buffer
+// moves the pixels, so they are marked as unknown.
+void
+Terminal::move_shown(const VTermRect& dest, const VTermRect& src)
+{
+  const unsigned rows = src.end_row - src.start_row;
+  const unsigned columns = src.end_col - src.start_col;
+  for (unsigned row = 0; row < rows; row++) {
+    const unsigned from = (src.start_row + row) * _columns + src.start_col;
+    memcpy(&_moved_chars[row * columns], &_shown_chars[from], columns);
+    memcpy(&_moved_attributes[row * columns], &_shown_attributes[from], columns * sizeof _moved_attributes[0]);
+    memcpy(&_moved_colors[row * columns], &_shown_colors[from], columns * sizeof _moved_colors[0]);
+    fill_n(&_shown_attributes[from], columns, SHOWN_UNKNOWN);
+  }
+  for (unsigned row = 0; row < rows; row++) {
+    const unsigned to = (dest.start_row + row) * _columns + dest.start_col;
+    memcpy(&_shown_chars[to], &_moved_chars[row * columns], columns);
+    memcpy(&_shown_attributes[to], &_moved_attributes[row * columns], columns * sizeof _moved_attributes[0]);
+    memcpy(&_shown_colors[to], &_moved_colors[row * columns], columns * sizeof _moved_colors[0]);
+  }
+  for (int row = min(src.start_row, dest.start_row); row < max(src.end_row, dest.end_row); row++) {
+    recount_blinking(row);
+  }
+}
+
+unsigned
+Terminal::count_blinking(unsigned shown, unsigned cells) const
+{
+  unsigned count = 0;
+  for (unsigned i = shown; i < shown + cells; i++) {
+    count += _shown_attributes[i] != SHOWN_UNKNOWN && (_shown_attributes[i] & Framebuffer::BLINK_ATTRIBUTE);
+  }
+  return count;
+}
+
+void
+Terminal::recount_blinking(unsigned row)
+{
+  _blinking_cells -= _blinking[row];
+  _blinking[row] = count_blinking(row * _columns, _columns);
+  _blinking_cells += _blinking[row];
+}
+
+// Whether all cells in rect will be rendered anyway
+bool
+Terminal::dirty(const VTermRect& rect) const
+{
+  for (int row = rect.start_row; row < rect.end_row; row++) {
+    const DirtySpan& span = _dirty[row];
+    if (span._start > rect.start_col || span._end < rect.end_col) {
+      return false;
+    }
+  }
+  return true;
+}
+
 int
 Terminal::damage(VTermRect rect)
 {
-  _framebuffer->remove_cursor();
+  Counters::add(Counters::DamageCallbacks);
+  for (int row = rect.start_row; row < rect.end_row; row++) {
+    mark_dirty(row, rect.start_col, rect.end_col);
+  }
+
+  return 1;
+}
+
+void
+Terminal::render()
+{
+  if (!_damaged) {
+    return;
+  }
+
+  PROFILE_STAGE(Render);
+  PROFILE_COUNT(frames_rendered, 1);
+
+  // Blinking cells that appear while no others are shown start out in
+  // the phase of the clock.
+  Scheduler& scheduler = _framebuffer->scheduler();
+  if (!Scheduler::pending(_blink_event)) {
+    _blink_on = (scheduler.now() % (2 * TEXT_BLINK_INTERVAL)) < TEXT_BLINK_INTERVAL;
+  }
 
+  auto term_state = vterm_obtain_state(_term);
   VTermPos pos;
-  for (pos.row = rect.start_row; pos.row < rect.end_row; pos.row++) {
-    for (pos.col = rect.start_col; pos.col < rect.end_col; pos.col++) {
-      VTermScreenCell cell;
-      vterm_screen_get_cell(_screen, pos, &cell);
+  for (pos.row = 0; pos.row < (int) _rows; pos.row++) {
+    DirtySpan& span = _dirty[pos.row];
+    if (span._start == span._end) {
+      continue;
+    }
+    // Cells that libvterm erases do not get the size of their line
+    const VTermLineInfo* lineinfo = vterm_state_get_lineinfo(term_state, pos.row);
+    const int cursor_column = (_cursor_visible && _cursor_on && pos.row == _cursor.row) ? _cursor.col : -1;
+    const unsigned length = span._end - span._start;
+    for (pos.col = span._start; pos.col < span._end; pos.col++) {
+      const unsigned i = pos.col - span._start;
+      VTermScreenCellAttrs& attributes = _span_cell_attributes[i];
+      if (_layer == Layer::State) {
+        const Cell& cell = _cells[pos.row * _columns + pos.col];
+        attributes = cell._attributes;
+        _span_chars[i] = cell._char;
+        _span_colors[i] = cell._foreground | (cell._background << 8);
+      } else {
+        VTermScreenCell cell;
+        vterm_screen_get_cell(_screen, pos, &cell);
+        attributes = cell.attrs;
+        _span_chars[i] = UnicodeMap::to_dec_char(cell.chars[0]);
+        _span_colors[i] = _framebuffer->foreground_index(cell.fg) | (_framebuffer->background_index(cell.bg) << 8);
+      }
+      attributes.dwl = lineinfo->doublewidth;
+      attributes.dhl = lineinfo->doubleheight;
+      if (attributes.blink && !_blink_on) {
+        attributes.conceal = 1;
+      }
+      _span_attributes[i] = Framebuffer::glyph_attributes(attributes, pos.col == cursor_column);
+    }
+
+    // Damage often covers cells that already show what they should
+    const unsigned shown = pos.row * _columns + span._start;
+    if (memcmp(&_shown_chars[shown], _span_chars.data(), length) == 0
+        && memcmp(&_shown_attributes[shown], _span_attributes.data(), length * sizeof _span_attributes[0]) == 0
+        && memcmp(&_shown_colors[shown], _span_colors.data(), length * sizeof _span_colors[0]) == 0) {
+      Counters::add(Counters::CellsSkipped, length);
+      PROFILE_COUNT(cells_skipped, length);
+      span._start = span._end = 0;
+      continue;
+    }
 
-      _framebuffer->putc(pos.row, pos.col,
-                         _unicode_map.to_dec_char(cell.chars[0]),
-                         cell.fg, cell.bg, cell.attrs);
+    // Short runs of unchanged cells between changed ones are rendered
+    // as well, so that the changed cells are written in one transfer.
+    unsigned rendered = 0;
+    unsigned first = 0;
+    unsigned end = 0;
+    for (unsigned i = 0; i < length; i++) {
+      if (_shown_chars[shown + i] == _span_chars[i]
+          && _shown_attributes[shown + i] == _span_attributes[i]
+          && _shown_colors[shown + i] == _span_colors[i]) {
+        continue;
+      }
+      if (end > first && i - end > MERGE_GAP) {
+        rendered += render_cells(pos.row, span._start, first, end, cursor_column);
+        first = i;
+      } else if (end == first) {
+        first = i;
+      }
+      end = i + 1;
+    }
+    if (end > first) {
+      rendered += render_cells(pos.row, span._start, first, end, cursor_column);
     }
+    PROFILE_COUNT(cells_rendered, rendered);
+    PROFILE_COUNT(cells_skipped, length - rendered);
+    Counters::add(Counters::CellsRendered, rendered);
+    Counters::add(Counters::CellsSkipped, length - rendered);
+    span._start = span._end = 0;
   }
+  _framebuffer->update();
+  _damaged = false;
 
-  return 1;
+  if (_blinking_cells && !Scheduler::pending(_blink_event)) {
+    const unsigned now = scheduler.now();
+    scheduler.schedule(_blink_event, now - (now % TEXT_BLINK_INTERVAL) + TEXT_BLINK_INTERVAL);
+  }
+}
+
+// Renders the cells from to end of the span that starts at the given
+// column and records them as shown.  Runs of cells that show nothing
+// but one color, like erased ones, are filled instead of rendering
+// each of them, and the cursor is drawn on top of the fill.
+unsigned
+Terminal::render_cells(int row, unsigned column, unsigned from, unsigned to, int cursor_column)
+{
+  auto solid = [&](unsigned i, GFX_COL& color) {
+    return Framebuffer::solid(_span_chars[i], _span_colors[i] & 0xff, _span_colors[i] >> 8, _span_cell_attributes[i], color);
+  };
+  auto putc = [&](unsigned i) {
+    _framebuffer->putc(row, column + i,
+                       _span_chars[i],
+                       _span_colors[i] & 0xff, _span_colors[i] >> 8,
+                       _span_cell_attributes[i],
+                       (int) (column + i) == cursor_column);
+  };
+
+  unsigned i = from;
+  while (i < to) {
+    GFX_COL color;
+    unsigned end = i + 1;
+    if (solid(i, color)) {
+      GFX_COL next_color;
+      while (end < to && solid(end, next_color) && next_color == color) {
+        end++;
+      }
+      if (end - i >= FILL_CELLS) {
+        _framebuffer->fill_rect(row, column + i, 1, end - i, color);
+        if (cursor_column >= (int) (column + i) && cursor_column < (int) (column + end)) {
+          putc(cursor_column - column);
+        }
+        i = end;
+        continue;
+      }
+    }
+    for (; i < end; i++) {
+      putc(i);
+    }
+  }
+
+  const unsigned shown = row * _columns + column;
+  const unsigned blinking_before = count_blinking(shown + from, to - from);
+  memcpy(&_shown_chars[shown + from], &_span_chars[from], to - from);
+  memcpy(&_shown_attributes[shown + from], &_span_attributes[from], (to - from) * sizeof _span_attributes[0]);
+  memcpy(&_shown_colors[shown + from], &_span_colors[from], (to - from) * sizeof _span_colors[0]);
+  const unsigned blinking_after = count_blinking(shown + from, to - from);
+  _blinking[row] += blinking_after - blinking_before;
+  _blinking_cells += blinking_after - blinking_before;
+
+  return to - from;
 }
 
 int
 Terminal::movecursor(VTermPos position, __unused VTermPos oldPosition, int visible)
 {
-  auto term_state = vterm_obtain_state(_term);
-  auto lineinfo = vterm_state_get_lineinfo(term_state, position.row);
-  _framebuffer->set_cursor(position.row, position.col,
-                           visible, lineinfo->doublewidth);
+  mark_cursor_dirty();
+
+  _cursor = position;
+  _cursor_visible = visible;
+  _cursor_on = true;
+  _cursor_moved = _timer->GetClockTicks();
+  Trace::record(TraceCursorSet, position.row, position.col, visible);
+
+  mark_cursor_dirty();
+  _framebuffer->scheduler().schedule(_cursor_event, _cursor_moved + CURSOR_BLINK_INTERVAL);
   return 1;
 }
 
+// Marks the cell that shows the cursor, or the one that its image has
+// been moved to by the given distance
+void
+Terminal::mark_cursor_dirty(int delta_rows, int delta_columns)
+{
+  const int row = _cursor.row + delta_rows;
+  const int column = _cursor.col + delta_columns;
+  if (_cursor_visible && row >= 0 && row < (int) _rows && column >= 0 && column < (int) _columns) {
+    mark_dirty(row, column, column + 1);
+  }
+}
+
+void
+Terminal::blink_cursor()
+{
+  const unsigned now = _timer->GetClockTicks();
+  const unsigned elapsed = now - _cursor_moved;
+  _cursor_on = (elapsed % (2 * CURSOR_BLINK_INTERVAL)) < CURSOR_BLINK_INTERVAL;
+  Trace::record(TraceCursorBlink, _cursor.row, _cursor.col, _cursor_on);
+  Counters::add(Counters::CursorRedraws);
+
+  mark_cursor_dirty();
+  _framebuffer->scheduler().schedule(_cursor_event, now - (elapsed % CURSOR_BLINK_INTERVAL) + CURSOR_BLINK_INTERVAL);
+}
+
+void
+Terminal::blink_cursor_stub(void* terminal)
+{
+  reinterpret_cast<Terminal*>(terminal)->blink_cursor();
+}
+
+// Marks the blinking cells as dirty.  The event is not scheduled again
+// when there are none, render() schedules it when they appear.
+void
+Terminal::blink_text()
+{
+  const unsigned now = _timer->GetClockTicks();
+  _blink_on = (now % (2 * TEXT_BLINK_INTERVAL)) < TEXT_BLINK_INTERVAL;
+  if (!_blinking_cells) {
+    return;
+  }
+
+  for (unsigned row = 0; row < _rows; row++) {
+    if (!_blinking[row]) {
+      continue;
+    }
+    const unsigned shown = row * _columns;
+    for (unsigned column = 0; column < _columns; column++) {
+      if (count_blinking(shown + column, 1)) {
+        mark_dirty(row, column, column + 1);
+      }
+    }
+  }
+  _framebuffer->scheduler().schedule(_blink_event, now - (now % TEXT_BLINK_INTERVAL) + TEXT_BLINK_INTERVAL);
+}
+
+void
+Terminal::blink_text_stub(void* terminal)
+{
+  reinterpret_cast<Terminal*>(terminal)->blink_text();
+}
+
 int
 Terminal::moverect(VTermRect dest, VTermRect src)
 {
-  log(LogDebug, "moverect called %u/%u:%u/%u -> %u:%u/%u:%u",
-      src.start_row, src.start_col, src.end_row, src.end_col,
-      dest.start_row, dest.start_col, dest.end_row, dest.end_col);
-  return 0;
-  
-  if (src.start_row < dest.start_row
-      || src.start_col < dest.start_col) {
-    // scroll down or right, not implemented yet.
+  if (_layer == Layer::Screen) {
+    return move_pixels(dest, src);
+  }
+
+  // The state layer does not damage cells whose pixels are not moved
+  move_cells(dest, src);
+  if (!move_pixels(dest, src)) {
+    damage(dest);
+  }
+  return 1;
+}
+
+void
+Terminal::move_cells(const VTermRect& dest, const VTermRect& src)
+{
+  const int rows = src.end_row - src.start_row;
+  const unsigned columns = src.end_col - src.start_col;
+  for (int i = 0; i < rows; i++) {
+    const int row = (dest.start_row > src.start_row) ? (rows - 1 - i) : i;
+    memmove(&_cells[(dest.start_row + row) * _columns + dest.start_col],
+            &_cells[(src.start_row + row) * _columns + src.start_col],
+            columns * sizeof _cells[0]);
+  }
+}
+
+// Moves the pixels of the cells and everything that follows them.
+// Returns 0 if the cells have to be rendered again instead.
+int
+Terminal::move_pixels(const VTermRect& dest, const VTermRect& src)
+{
+  // The counter overlay would move with the pixels, so the cells are
+  // rendered again while it is shown.
+  if (_show_counters) {
     return 0;
-  } else {
-    _framebuffer->move_rect(src.start_row, src.start_col,
-                            dest.start_row, dest.start_col,
-                            src.end_row - src.start_row,
-                            src.end_col - src.start_col,
-                            0);
+  }
+
+  // Double width lines use twice the pixels per column, so partial
+  // lines can only be moved if none of them is double width.
+  if (src.start_col != 0 || src.end_col != (int) _columns) {
+    auto term_state = vterm_obtain_state(_term);
+    for (int row = min(src.start_row, dest.start_row); row < max(src.end_row, dest.end_row); row++) {
+      if (vterm_state_get_lineinfo(term_state, row)->doublewidth) {
+        return 0;
+      }
+    }
+  }
+
+  // When more input arrives than can be displayed, the screen scrolls
+  // by more than a page between frames.  The pixels moved would then
+  // be rendered again anyway, so the scrolled out intermediate states
+  // are skipped without touching the frame buffer (jump scroll).
+  const bool skip = dirty(src);
+
+  // Damage that has not been rendered yet moves with the pixels.  The
+  // rows are visited in an order that reads each span before it is
+  // updated.
+  const int rows = src.end_row - src.start_row;
+  const int delta_rows = dest.start_row - src.start_row;
+  const int delta_columns = dest.start_col - src.start_col;
+  for (int i = 0; i < rows; i++) {
+    const int row = (delta_rows > 0) ? (src.end_row - 1 - i) : (src.start_row + i);
+    const DirtySpan& span = _dirty[row];
+    const int start = max<int>(span._start, src.start_col);
+    const int end = min<int>(span._end, src.end_col);
+    if (start < end) {
+      mark_dirty(row + delta_rows, start + delta_columns, end + delta_columns);
+    }
+  }
+
+  if (skip) {
+    PROFILE_COUNT(moves_skipped, 1);
     return 1;
   }
+
+  // The image of the cursor moves with the pixels, and the cell that
+  // shows it may be overwritten.
+  if (_cursor.row >= src.start_row && _cursor.row < src.end_row
+      && _cursor.col >= src.start_col && _cursor.col < src.end_col) {
+    mark_cursor_dirty(delta_rows, delta_columns);
+  }
+  mark_cursor_dirty();
+
+  move_shown(dest, src);
+
+  _framebuffer->move_rect(src.start_row, src.start_col,
+                          dest.start_row, dest.start_col,
+                          rows,
+                          src.end_col - src.start_col,
+                          0);
+  return 1;
+}
+
+// DECSCNM switches the whole screen to reverse video through the
+// palette.  With the state layer, the alternate screen is switched by
+// exchanging the cells, libvterm erases it when it is entered.
+int
+Terminal::settermprop(VTermProp prop, VTermValue* value)
+{
+  if (prop == VTERM_PROP_REVERSE) {
+    _framebuffer->set_reverse_video(value->boolean);
+  } else if (prop == VTERM_PROP_ALTSCREEN && _layer == Layer::State) {
+    if (_alternate_screen != bool(value->boolean)) {
+      _alternate_screen = value->boolean;
+      _cells.swap(_alternate_cells);
+      damage(VTermRect { 0, (int) _rows, 0, (int) _columns });
+    }
+  }
+  return 1;
+}
+
+int
+Terminal::putglyph(VTermGlyphInfo* info, VTermPos position)
+{
+  Cell* cell = &_cells[position.row * _columns + position.col];
+  *cell = _pen;
+  cell->_char = UnicodeMap::to_dec_char(info->chars[0]);
+  cell->_protected = info->protected_cell;
+
+  // The columns covered by a wide character keep their pen
+  int end = min<int>(position.col + info->width, _columns);
+  for (int column = position.col + 1; column < end; column++) {
+    (++cell)->_char = UnicodeMap::to_dec_char(uint32_t(-1));
+  }
+
+  damage(VTermRect { position.row, position.row + 1, position.col, end });
+  return 1;
+}
+
+int
+Terminal::erase(VTermRect rect, int selective)
+{
+  erase_cells(rect, selective);
+  damage(rect);
+  return 1;
+}
+
+// Erased cells get the current pen, selective erase leaves the
+// protected ones alone.
+void
+Terminal::erase_cells(const VTermRect& rect, bool selective)
+{
+  Cell blank = _pen;
+  blank._char = UnicodeMap::to_dec_char(0);
+  for (int row = rect.start_row; row < rect.end_row; row++) {
+    Cell* cell = &_cells[row * _columns + rect.start_col];
+    for (int column = rect.start_col; column < rect.end_col; column++, cell++) {
+      if (!selective || !cell->_protected) {
+        *cell = blank;
+      }
+    }
+  }
+}
+
+int
+Terminal::initpen()
+{
+  VTermColor foreground;
+  VTermColor background;
+  vterm_state_get_default_colors(vterm_obtain_state(_term), &foreground, &background);
+  _pen = Cell {};
+  _pen._foreground = _framebuffer->foreground_index(foreground);
+  _pen._background = _framebuffer->background_index(background);
+  return 1;
+}
+
+// The colors are looked up in the palette once, when the pen changes,
+// rather than for every cell that is rendered.
+int
+Terminal::setpenattr(VTermAttr attribute, VTermValue* value)
+{
+  switch (attribute) {
+  case VTERM_ATTR_BOLD:
+    _pen._attributes.bold = value->boolean;
+    break;
+  case VTERM_ATTR_UNDERLINE:
+    _pen._attributes.underline = value->number;
+    break;
+  case VTERM_ATTR_ITALIC:
+    _pen._attributes.italic = value->boolean;
+    break;
+  case VTERM_ATTR_BLINK:
+    _pen._attributes.blink = value->boolean;
+    break;
+  case VTERM_ATTR_REVERSE:
+    _pen._attributes.reverse = value->boolean;
+    break;
+  case VTERM_ATTR_CONCEAL:
+    _pen._attributes.conceal = value->boolean;
+    break;
+  case VTERM_ATTR_STRIKE:
+    _pen._attributes.strike = value->boolean;
+    break;
+  case VTERM_ATTR_FONT:
+    _pen._attributes.font = value->number;
+    break;
+  case VTERM_ATTR_FOREGROUND:
+    _pen._foreground = _framebuffer->foreground_index(value->color);
+    break;
+  case VTERM_ATTR_BACKGROUND:
+    _pen._background = _framebuffer->background_index(value->color);
+    break;
+  default:
+    return 0;
+  }
+  return 1;
+}
+
+// A line that becomes double width loses the cells of its right half
+int
+Terminal::setlineinfo(int row, const VTermLineInfo* new_info, const VTermLineInfo* old_info)
+{
+  if (new_info->doublewidth == old_info->doublewidth && new_info->doubleheight == old_info->doubleheight) {
+    return 1;
+  }
+  if (new_info->doublewidth) {
+    erase_cells(VTermRect { row, row + 1, (int) _columns / 2, (int) _columns }, false);
+  }
+  damage(VTermRect { row, row + 1, 0, (int) _columns });
+  return 1;
+}
+
+int
+Terminal::bell()
+{
+  _framebuffer->flash();
+  return 1;
+}
+
+void
+Terminal::output(const char* s, size_t length)
+{
+  if (_probe) {
+    _probe->append(s, length);
+  } else {
+    uart_write(s, length);
+  }
+}
+
+// libvterm keeps the keyboard modes to itself, but it sends SS3
+// sequences for the cursor keys and the keypad when they are in
+// application mode.
+bool
+Terminal::application_mode(VTermKey key)
+{
+  string sequence;
+  _probe = &sequence;
+  vterm_keyboard_key(_term, key, VTERM_MOD_NONE);
+  _probe = nullptr;
+  return sequence.length() > 1 && sequence[0] == '\x1b' && sequence[1] == 'O';
+}
+
+void
+Terminal::scan_modes(const char* data, size_t length)
+{
+  const char* p = data;
+  const char* end = data + length;
+  while (p < end) {
+    if (_scan_state == Ground) {
+      p = static_cast<const char*>(memchr(p, '\x1b', end - p));
+      if (!p) {
+        return;
+      }
+      p++;
+      _scan_state = Escape;
+      continue;
+    }
+
+    const char c = *p++;
+    if (c == '\x1b') {
+      _scan_state = Escape;
+    } else if (_scan_state == Escape) {
+      if (c == '[') {
+        _scan_state = ControlSequence;
+        _scan_private = false;
+        _scan_autorepeat = false;
+        _scan_parameter = 0;
+      } else {
+        if (c == 'c') {
+          _keyboard->set_autorepeat(true);
+        }
+        _scan_state = Ground;
+      }
+    } else if (c == '?') {
+      _scan_private = true;
+    } else if (c >= '0' && c <= '9') {
+      _scan_parameter = min(_scan_parameter * 10 + (c - '0'), 10000u);
+    } else if (c == ';') {
+      _scan_autorepeat = _scan_autorepeat || _scan_parameter == 8;
+      _scan_parameter = 0;
+    } else if (c >= 0x40 || c == '\x18' || c == '\x1a') {
+      _scan_autorepeat = _scan_autorepeat || _scan_parameter == 8;
+      if (_scan_private && _scan_autorepeat && (c == 'h' || c == 'l')) {
+        _keyboard->set_autorepeat(c == 'h');
+      }
+      if (_scan_private && c == 'q' && _scan_parameter == 999) {
+        report_counters();
+      }
+      _scan_state = Ground;
+    }
+  }
 }
 
 void
 Terminal::uart_write(const string& s)
 {
-  _serial_port->Write(s.c_str(), s.length());
+  uart_write(s.c_str(), s.length());
 }
 
 void
 Terminal::uart_write(const char* s, size_t length)
 {
-  _serial_port->Write(s, length);
+  if (!_replay.active()) {
+    _serial_port->write(s, length);
+  }
 }
 
 void
 Terminal::uart_set_speed(unsigned speed)
 {
-  _serial_port->SetSpeed(speed);
+  _serial_port->set_speed(speed);
   _serial_speed = speed;
 }
 
-Terminal::UnicodeMap::UnicodeMap()
-{
-  _map[0x0020] = 0x00; // SPACE
-  _map[0x25C6] = 0x01; // BLACK DIAMOND
-  _map[0x2592] = 0x02; // MEDIUM SHADE (checkerboard)
-  _map[0x2409] = 0x03; // SYMBOL FOR HORIZONTAL TAB
-  _map[0x240C] = 0x04; // SYMBOL FOR FORM FEED
-  _map[0x240D] = 0x05; // SYMBOL FOR CARRIAGE RETURN
-  _map[0x240A] = 0x06; // SYMBOL FOR LINE FEED
-  _map[0x00B0] = 0x07; // DEGREE SIGN
-  _map[0x00B1] = 0x08; // PLUS-MINUS SIGN (plus or minus)
-  _map[0x2424] = 0x09; // SYMBOL FOR NEW LINE
-  _map[0x240B] = 0x0a; // SYMBOL FOR VERTICAL TAB
-  _map[0x2518] = 0x0b; // BOX DRAWINGS LIGHT UP AND LEFT (bottom-right corner)
-  _map[0x2510] = 0x0c; // BOX DRAWINGS LIGHT DOWN AND LEFT (top-right corner)
-  _map[0x250C] = 0x0d; // BOX DRAWINGS LIGHT DOWN AND RIGHT (top-left corner)
-  _map[0x2514] = 0x0e; // BOX DRAWINGS LIGHT UP AND RIGHT (bottom-left corner)
-  _map[0x253C] = 0x0f; // BOX DRAWINGS LIGHT VERTICAL AND HORIZONTAL (crossing lines)
-  _map[0x23BA] = 0x10; // HORIZONTAL SCAN LINE-1
-  _map[0x23BB] = 0x11; // HORIZONTAL SCAN LINE-3
-  _map[0x2500] = 0x12; // BOX DRAWINGS LIGHT HORIZONTAL
-  _map[0x23BC] = 0x13; // HORIZONTAL SCAN LINE-7
-  _map[0x23BD] = 0x14; // HORIZONTAL SCAN LINE-9
-  _map[0x251C] = 0x15; // BOX DRAWINGS LIGHT VERTICAL AND RIGHT
-  _map[0x2524] = 0x16; // BOX DRAWINGS LIGHT VERTICAL AND LEFT
-  _map[0x2534] = 0x17; // BOX DRAWINGS LIGHT UP AND HORIZONTAL
-  _map[0x252C] = 0x18; // BOX DRAWINGS LIGHT DOWN AND HORIZONTAL
-  _map[0x2502] = 0x19; // BOX DRAWINGS LIGHT VERTICAL
-  _map[0x2A7D] = 0x1a; // LESS-THAN OR SLANTED EQUAL-TO
-  _map[0x2A7E] = 0x1b; // GREATER-THAN OR SLANTED EQUAL-TO
-  _map[0x03C0] = 0x1c; // GREEK SMALL LETTER PI
-  _map[0x2260] = 0x1d; // NOT EQUAL TO
-  _map[0x00A3] = 0x1e; // POUND SIGN
-  _map[0x00B7] = 0x1f; // MIDDLE DOT
-}
-
 void
 Terminal::process()
 {
+  const unsigned start = _timer->GetClockTicks();
+
+  // All available input is parsed before the damage is rendered, but
+  // the screen is updated at least once per frame interval.
   char buf[1024];
-  int serial_bytes_available = _serial_port->Read(buf, sizeof buf);
-  if (serial_bytes_available > 0) {
+  size_t serial_bytes_available;
+  while ((serial_bytes_available = read_input(buf, sizeof buf)) > 0) {
+    PROFILE_STAGE(Parse);
+    PROFILE_COUNT(bytes_received, serial_bytes_available);
+    Counters::add(Counters::BytesParsed, serial_bytes_available);
     vterm_input_write(_term, buf, serial_bytes_available);
-  } else if (serial_bytes_available < 0) {
-    switch (serial_bytes_available) {
-    case -SERIAL_ERROR_BREAK:
-      log(LogError, "Could not read from serial port (break)");
-      break;
-    case -SERIAL_ERROR_OVERRUN:
-      log(LogError, "Could not read from serial port (overrun)");
-      break;
-    case -SERIAL_ERROR_FRAMING:
-      log(LogError, "Could not read from serial port (framing error)");
+    scan_modes(buf, serial_bytes_available);
+    if (_timer->GetClockTicks() - _last_frame >= _frame_interval) {
       break;
-    default:
-      log(LogError, "Could not read from serial port (unexpected return code %d)", serial_bytes_available);
+    }
+  }
+
+  log_serial_errors();
+
+  const unsigned now = _timer->GetClockTicks();
+  if (!input_available() || now - _last_frame >= _frame_interval) {
+    const bool damaged = _damaged;
+    render();
+    _last_frame = now;
+    if (_show_counters && (damaged || now - _counters_shown >= COUNTERS_INTERVAL)) {
+      show_counters();
+      _counters_shown = now;
     }
   }
 
   _framebuffer->process();
   _keyboard->process();
+
+  // Trace records and the capture are only written while there is
+  // nothing to do
+  if (!input_available()) {
+    Trace::drain(TRACE_DRAIN_RECORDS);
+    _capture.drain(CAPTURE_DRAIN_MICROSECONDS);
+  }
+
+  const unsigned duration = _timer->GetClockTicks() - start;
+  Counters::add(Counters::LoopIterations);
+  Counters::add(Counters::LoopMicroseconds, duration);
+  Counters::maximum(Counters::LoopMaxMicroseconds, duration);
+}
+
+// Reads from the serial port or from the session being replayed
+size_t
+Terminal::read_input(char* buffer, size_t size)
+{
+  if (_replay.active()) {
+    return _replay.read(buffer, size, _keyboard.get());
+  }
+
+  const size_t length = _serial_port->read(buffer, size);
+  if (length) {
+    _capture.data(buffer, length);
+  }
+  return length;
+}
+
+bool
+Terminal::input_available()
+{
+  return _replay.active() ? _replay.available() : _serial_port->available() > 0;
+}
+
+void
+Terminal::set_frame_rate(unsigned frames_per_second)
+{
+  _frame_interval = frames_per_second ? (1000000 / frames_per_second) : 0;
+}
+
+void
+Terminal::log_serial_errors()
+{
+  const SerialPort::Counters& counters = _serial_port->counters();
+  if (memcmp(&counters, &_serial_counters, sizeof counters) == 0) {
+    return;
+  }
+
+  auto report = [this](unsigned now, unsigned& then, const char* what) {
+    if (now != then) {
+      log(LogError, "Serial port: %u %s", now - then, what);
+      then = now;
+    }
+  };
+  report(counters._overruns, _serial_counters._overruns, "bytes lost, receive buffer full");
+  report(counters._hardware_overruns, _serial_counters._hardware_overruns, "receive FIFO overruns");
+  report(counters._framing_errors, _serial_counters._framing_errors, "framing errors");
+  report(counters._parity_errors, _serial_counters._parity_errors, "parity errors");
+  report(counters._breaks, _serial_counters._breaks, "breaks");
+  report(counters._transmit_drops, _serial_counters._transmit_drops, "bytes lost, transmit buffer full");
+  _serial_counters._throttles = counters._throttles;
+}
+
+void
+Terminal::redraw()
+{
+  fill(_shown_attributes.begin(), _shown_attributes.end(), SHOWN_UNKNOWN);
+  fill(_blinking.begin(), _blinking.end(), 0);
+  _blinking_cells = 0;
+  for (unsigned row = 0; row < _rows; row++) {
+    mark_dirty(row, 0, _columns);
+  }
+  render();
 }
 
 void
@@ -227,8 +981,174 @@ Terminal::cycle_serial_speed()
   display_status(os.str());
 }
 
+void
+Terminal::cycle_flow_control()
+{
+  auto flow_control = static_cast<SerialPort::FlowControl>((_serial_port->flow_control() + 1) % 3);
+  _serial_port->set_flow_control(flow_control);
+  ostringstream os;
+  os << "Flow control set to " << SerialPort::flow_control_name(flow_control);
+  display_status(os.str());
+}
+
+void
+Terminal::cycle_color_scheme()
+{
+  ostringstream os;
+  os << "Color scheme set to " << _framebuffer->cycle_color_scheme();
+  display_status(os.str());
+}
+
+void
+Terminal::cycle_brightness()
+{
+  ostringstream os;
+  os << "Brightness set to " << _framebuffer->cycle_brightness() << "%";
+  display_status(os.str());
+}
+
 void
 Terminal::toggle_screen_size()
 {
   display_status("Not yet implemented");
 }
+
+bool
+Terminal::start_capture(const char* filename)
+{
+  _replay.stop();
+  return _capture.start(filename);
+}
+
+void
+Terminal::stop_capture()
+{
+  _capture.stop();
+}
+
+bool
+Terminal::start_replay(const char* filename, bool original_speed)
+{
+  _capture.stop();
+  return _replay.start(filename, original_speed);
+}
+
+// Stops a replay, or starts or stops a capture
+void
+Terminal::toggle_capture()
+{
+  ostringstream os;
+  if (_replay.active()) {
+    _replay.stop();
+    os << "Replay stopped";
+  } else if (_capture.active()) {
+    stop_capture();
+    os << "Capture stopped, " << _capture.bytes_written() << " bytes written to " << CAPTURE_FILE;
+  } else if (start_capture(CAPTURE_FILE)) {
+    os << "Capturing to " << CAPTURE_FILE;
+  } else {
+    os << "Cannot create " << CAPTURE_FILE;
+  }
+  display_status(os.str());
+}
+
+// The replay shows the session on the current screen.  The message is
+// the same while capturing and replaying, so that a replayed capture
+// shows what was shown when it was recorded.
+void
+Terminal::replay_capture(bool original_speed)
+{
+  if (_capture.active() || _replay.active()) {
+    display_status("Capture or replay in progress");
+  } else if (!start_replay(CAPTURE_FILE, original_speed)) {
+    display_status(string("Cannot replay ") + CAPTURE_FILE);
+  }
+}
+
+void
+Terminal::toggle_counters()
+{
+  _show_counters = !_show_counters;
+  if (_show_counters) {
+    show_counters();
+    _counters_shown = _timer->GetClockTicks();
+  } else {
+    redraw();
+  }
+}
+
+vector<Terminal::CounterValue>
+Terminal::counter_values() const
+{
+  const SerialPort::Counters& serial = _serial_port->counters();
+  vector<CounterValue> values {
+    { "received", serial._received },
+    { "overruns", serial._overruns },
+    { "fifo_overruns", serial._hardware_overruns },
+    { "framing_errors", serial._framing_errors },
+    { "parity_errors", serial._parity_errors },
+    { "breaks", serial._breaks },
+    { "throttles", serial._throttles },
+    { "transmit_drops", serial._transmit_drops },
+  };
+  for (unsigned i = 0; i < Counters::COUNTERS; i++) {
+    const auto counter = static_cast<Counters::Counter>(i);
+    values.push_back(CounterValue { Counters::name(counter), Counters::get(counter) });
+  }
+  return values;
+}
+
+// Drawn directly into the frame buffer in reverse video, on top of the
+// screen contents.  The overlay is redrawn after the cells below it
+// have been rendered.
+void
+Terminal::show_counters()
+{
+  static const unsigned WIDTH = 28;
+
+  VTermColor foreground;
+  VTermColor background;
+  vterm_state_get_default_colors(vterm_obtain_state(_term), &foreground, &background);
+  VTermScreenCellAttrs attributes {};
+  attributes.reverse = 1;
+
+  unsigned row = 1;
+  for (const CounterValue& value : counter_values()) {
+    if (row >= _rows) {
+      break;
+    }
+    char line[WIDTH + 1];
+    snprintf(line, sizeof line, " %-15s %10u ", value._name, value._value);
+    for (unsigned i = 0; line[i]; i++) {
+      _framebuffer->putc(row, _columns - WIDTH - 1 + i, line[i],
+                         _framebuffer->foreground_index(foreground),
+                         _framebuffer->background_index(background),
+                         attributes);
+    }
+    row++;
+  }
+  _framebuffer->update();
+}
+
+// Sent as DCS > 999 | name=value;... ST so that hosts can collect the
+// counters.
+void
+Terminal::report_counters()
+{
+  string report("\x1bP>999|");
+  char value[16];
+  bool first = true;
+  for (const CounterValue& counter : counter_values()) {
+    if (!first) {
+      report += ';';
+    }
+    first = false;
+    snprintf(value, sizeof value, "=%u", counter._value);
+    report += counter._name;
+    report += value;
+  }
+  report += "\x1b\\";
+  uart_write(report);
+
+  Counters::reset(Counters::LoopMaxMicroseconds);
+}
@@ -3,60 +3,230 @@
 #pragma once
 
 #include <memory>
-#include <map>
+#include <vector>
 
 #include <vterm.h>
 
 #include <circle/timer.h>
 
 #include "Logging.h"
+#include "Capture.h"
 #include "Framebuffer.h"
 #include "Keyboard.h"
+#include "Replay.h"
+#include "Scheduler.h"
+#include "SerialPort.h"
 
 using namespace std;
 
-class CSerialDevice;
-
 class Terminal
   : protected Logging
 {
  public:
-  Terminal(CSerialDevice* serial_port);
+  // The contents of the screen are either kept by the terminal itself,
+  // which follows the drawing operations of libvterm's state layer, or
+  // by libvterm's screen layer, from which the cells are copied out
+  // when they are rendered.  The screen layer stores every cell with
+  // its Unicode characters and RGB colors, so the state layer uses less
+  // memory and time.  Both must show the same.
+  enum class Layer {
+    Screen,
+    State
+  };
+
+  Terminal(SerialPort* serial_port, Layer layer = Layer::State);
 
   int damage(VTermRect rect);
   int movecursor(VTermPos position, __unused VTermPos oldPosition, int visible);
   int moverect(VTermRect dest, VTermRect src);
+  int settermprop(VTermProp prop, VTermValue* value);
+  int bell();
+
+  // State layer callbacks
+  int putglyph(VTermGlyphInfo* info, VTermPos position);
+  int erase(VTermRect rect, int selective);
+  int initpen();
+  int setpenattr(VTermAttr attribute, VTermValue* value);
+  int setlineinfo(int row, const VTermLineInfo* new_info, const VTermLineInfo* old_info);
+
+  // Called by libvterm with data for the host
+  void output(const char* s, size_t length);
 
   void uart_write(const string& s);
   void uart_write(const char* s, size_t length);
   void uart_set_speed(unsigned speed);
 
+  // DECCKM and DECKPAM
+  bool application_cursor_keys() { return application_mode(VTERM_KEY_UP); }
+  bool application_keypad() { return application_mode(VTERM_KEY_KP_0); }
+
   void display_status(const string& s);
 
   void cycle_serial_speed();
+  void cycle_flow_control();
+  void cycle_color_scheme();
+  void cycle_brightness();
   void toggle_screen_size();
 
+  // Sessions are captured to and replayed from a file on the SD card.
+  // While a session is replayed, the serial port is not read and
+  // nothing is sent to the host.
+  bool start_capture(const char* filename);
+  void stop_capture();
+  bool start_replay(const char* filename, bool original_speed);
+  bool replaying() const { return _replay.active(); }
+  Capture& capture() { return _capture; }
+  void toggle_capture();
+  void replay_capture(bool original_speed);
+
+  // Shows or hides the counters in the upper right corner of the screen
+  void toggle_counters();
+
   void process();
 
+  // Damage is rendered at most this many times per second while input
+  // keeps arriving, and right away when no more input is available.
+  // With a rate of 0, every chunk of input is rendered.
+  void set_frame_rate(unsigned frames_per_second);
+
+  // Renders the whole screen from the stored cell contents
+  void redraw();
+
  private:
   shared_ptr<Framebuffer> _framebuffer;
   shared_ptr<Keyboard> _keyboard;
 
-  CSerialDevice* _serial_port;
+  SerialPort* _serial_port;
   unsigned _serial_speed;
+  // Error counters of the serial port when they were last logged
+  SerialPort::Counters _serial_counters;
 
-  VTerm* _term;
-  VTermScreen* _screen;
-  VTermScreenCallbacks _callbacks;
+  CTimer* _timer;
+  unsigned _frame_interval;
+  unsigned _last_frame;
 
-  class UnicodeMap {
-  public:
-    UnicodeMap();
+  bool _show_counters;
+  unsigned _counters_shown;
 
-    map<uint32_t, uint8_t> _map;
+  // Receives the output of libvterm instead of the serial port
+  string* _probe;
 
-    uint8_t to_dec_char(uint32_t code) { return _map.count(code) ? _map[code] : code; }
-  };
+  Capture _capture;
+  Replay _replay;
 
-  UnicodeMap _unicode_map;
+  VTerm* _term;
+  Layer _layer;
+  VTermScreen* _screen;
+  VTermScreenCallbacks _callbacks;
+  VTermState* _state;
+  VTermStateCallbacks _state_callbacks;
+
+  unsigned _rows;
+  unsigned _columns;
+
+  // With the state layer, each cell is stored as it is rendered: with
+  // its font position and the palette indices of its colors.  The pen
+  // is the cell that glyphs and erased cells are written with.  The
+  // alternate screen has cells of its own.
+  struct Cell {
+    VTermScreenCellAttrs _attributes;
+    uint8_t _char;
+    GFX_COL _foreground;
+    GFX_COL _background;
+    bool _protected;
+  };
+  vector<Cell> _cells;
+  vector<Cell> _alternate_cells;
+  bool _alternate_screen;
+  Cell _pen;
+
+  // Damage reported by libvterm is collected as one span of columns
+  // per row and rendered at the end of each process() call.
+  struct DirtySpan {
+    unsigned short _start;
+    unsigned short _end;
+  };
+  vector<DirtySpan> _dirty;
+  bool _damaged;
+
+  // What the frame buffer shows: the font position, the glyph
+  // attributes and the palette indices of the foreground and background
+  // colors of each cell, in separate arrays so that spans can be
+  // compared with memcmp().  Cells whose values are unchanged are not
+  // rendered again.
+  static constexpr uint16_t SHOWN_UNKNOWN = 0xffff;
+  vector<uint8_t> _shown_chars;
+  vector<uint16_t> _shown_attributes;
+  vector<uint16_t> _shown_colors;
+
+  // The span being rendered and the cells being moved
+  vector<VTermScreenCellAttrs> _span_cell_attributes;
+  vector<uint8_t> _span_chars;
+  vector<uint16_t> _span_attributes;
+  vector<uint16_t> _span_colors;
+  vector<uint8_t> _moved_chars;
+  vector<uint16_t> _moved_attributes;
+  vector<uint16_t> _moved_colors;
+
+  // The cursor is drawn by rendering the cell below it with the cursor
+  // flag, so nothing has to be removed from the frame buffer before
+  // cells are rendered or moved.  Moving it or changing its blink
+  // phase marks the cells that it leaves and enters as dirty.  The
+  // blink period restarts when the cursor is moved.
+  VTermPos _cursor;
+  bool _cursor_visible;
+  bool _cursor_on;
+  unsigned _cursor_moved;
+  Scheduler::Event _cursor_event;
+
+  // Blinking text is hidden by rendering it concealed every other half
+  // second.  The blinking cells that are shown are counted per row, so
+  // that a change of the blink phase only marks them as dirty, and only
+  // while there are any.
+  vector<unsigned short> _blinking;
+  unsigned _blinking_cells;
+  bool _blink_on;
+  Scheduler::Event _blink_event;
+
+  // libvterm does not implement DECARM or the counter report, so the
+  // input is scanned for the sequences that set and reset private mode
+  // 8, for CSI ? 999 q and for RIS.
+  enum ScanState {
+    Ground,
+    Escape,
+    ControlSequence
+  };
+  ScanState _scan_state;
+  bool _scan_private;
+  bool _scan_autorepeat;
+  unsigned _scan_parameter;
+
+  void mark_dirty(int row, int start_column, int end_column);
+  void mark_cursor_dirty(int delta_rows = 0, int delta_columns = 0);
+  void blink_cursor();
+  static void blink_cursor_stub(void* terminal);
+  void blink_text();
+  static void blink_text_stub(void* terminal);
+  unsigned count_blinking(unsigned shown, unsigned cells) const;
+  void recount_blinking(unsigned row);
+  bool dirty(const VTermRect& rect) const;
+  void move_shown(const VTermRect& dest, const VTermRect& src);
+  void move_cells(const VTermRect& dest, const VTermRect& src);
+  int move_pixels(const VTermRect& dest, const VTermRect& src);
+  void erase_cells(const VTermRect& rect, bool selective);
+  void render();
+  unsigned render_cells(int row, unsigned column, unsigned from, unsigned to, int cursor_column);
+  size_t read_input(char* buffer, size_t size);
+  bool input_available();
+  void log_serial_errors();
+  bool application_mode(VTermKey key);
+  void scan_modes(const char* data, size_t length);
+
+  struct CounterValue {
+    const char* _name;
+    unsigned _value;
+  };
+  vector<CounterValue> counter_values() const;
+  void show_counters();
+  void report_counters();
 };
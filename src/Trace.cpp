@@ -0,0 +1,46 @@
+
+#include <circle/logger.h>
+
+#include "Trace.h"
+
+using namespace std;
+
+RingBuffer<Trace::Record, Trace::RECORDS> Trace::_records;
+unsigned Trace::_lost;
+unsigned Trace::_lost_logged;
+
+struct TraceFormat
+{
+  const char* _source;
+  const char* _format;
+};
+
+// Indexed by TraceEvent
+static const TraceFormat formats[TraceEvents] = {
+  { "Framebuffer", "%u: Move %d/%d -> %d/%d, %d rows %d columns" },
+  { "Framebuffer", "%u: Pan %d rows from virtual offset %d" },
+  { "Terminal", "%u: Set cursor to %d/%d (visible %d)" },
+  { "Terminal", "%u: Cursor %d/%d blink state changed to %d" },
+};
+
+void
+Trace::drain(unsigned count)
+{
+  CLogger* logger = CLogger::Get();
+  Record record;
+  while (count-- && _records.pop(record)) {
+    if (logger) {
+      const TraceFormat& format = formats[record._event];
+      logger->Write(format._source, LogNotice, format._format,
+                    record._time, record._args[0], record._args[1], record._args[2],
+                    record._args[3], record._args[4], record._args[5]);
+    }
+  }
+
+  if (_lost != _lost_logged) {
+    if (logger) {
+      logger->Write("Trace", LogNotice, "%u trace records lost", _lost - _lost_logged);
+    }
+    _lost_logged = _lost;
+  }
+}
@@ -0,0 +1,53 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <cstdint>
+
+#include <circle/timer.h>
+
+#include "RingBuffer.h"
+
+using namespace std;
+
+// Diagnostic events of the hot paths.  Recording one stores its ID, the
+// time and up to six small integer arguments in a ring, which is formatted
+// and written to the log only when the main loop has nothing else to
+// do.  Events are recorded from the main loop only.
+enum TraceEvent : uint8_t {
+  TraceMoveRect,
+  TracePan,
+  TraceCursorSet,
+  TraceCursorBlink,
+  TraceEvents
+};
+
+class Trace
+{
+public:
+  static void
+  record(TraceEvent event, int16_t arg0 = 0, int16_t arg1 = 0, int16_t arg2 = 0,
+         int16_t arg3 = 0, int16_t arg4 = 0, int16_t arg5 = 0)
+  {
+    if (!_records.push(Record { CTimer::Get()->GetClockTicks(), event, { arg0, arg1, arg2, arg3, arg4, arg5 } })) {
+      _lost++;
+    }
+  }
+
+  // Writes up to the given number of records to the log
+  static void drain(unsigned count = RECORDS);
+
+private:
+  struct Record
+  {
+    unsigned _time;
+    TraceEvent _event;
+    int16_t _args[6];
+  };
+
+  static const size_t RECORDS = 256;
+
+  static RingBuffer<Record, RECORDS> _records;
+  static unsigned _lost;
+  static unsigned _lost_logged;
+};
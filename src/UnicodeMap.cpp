@@ -0,0 +1,178 @@
+
+#include "UnicodeMap.h"
+
+using namespace std;
+
+struct Mapping
+{
+  uint32_t _code;
+  uint8_t _dec;
+};
+
+// Code points that are not shown with the glyph at the same position
+// in the font.  Code points below U+0100 that are not listed map to
+// themselves.
+static constexpr Mapping mappings[] = {
+  // DEC Special Graphics
+  { 0x0020, 0x00 }, // SPACE
+  { 0x25C6, 0x01 }, // BLACK DIAMOND
+  { 0x2592, 0x02 }, // MEDIUM SHADE (checkerboard)
+  { 0x2409, 0x03 }, // SYMBOL FOR HORIZONTAL TAB
+  { 0x240C, 0x04 }, // SYMBOL FOR FORM FEED
+  { 0x240D, 0x05 }, // SYMBOL FOR CARRIAGE RETURN
+  { 0x240A, 0x06 }, // SYMBOL FOR LINE FEED
+  { 0x00B0, 0x07 }, // DEGREE SIGN
+  { 0x00B1, 0x08 }, // PLUS-MINUS SIGN (plus or minus)
+  { 0x2424, 0x09 }, // SYMBOL FOR NEW LINE
+  { 0x240B, 0x0a }, // SYMBOL FOR VERTICAL TAB
+  { 0x2518, 0x0b }, // BOX DRAWINGS LIGHT UP AND LEFT (bottom-right corner)
+  { 0x2510, 0x0c }, // BOX DRAWINGS LIGHT DOWN AND LEFT (top-right corner)
+  { 0x250C, 0x0d }, // BOX DRAWINGS LIGHT DOWN AND RIGHT (top-left corner)
+  { 0x2514, 0x0e }, // BOX DRAWINGS LIGHT UP AND RIGHT (bottom-left corner)
+  { 0x253C, 0x0f }, // BOX DRAWINGS LIGHT VERTICAL AND HORIZONTAL (crossing lines)
+  { 0x23BA, 0x10 }, // HORIZONTAL SCAN LINE-1
+  { 0x23BB, 0x11 }, // HORIZONTAL SCAN LINE-3
+  { 0x2500, 0x12 }, // BOX DRAWINGS LIGHT HORIZONTAL
+  { 0x23BC, 0x13 }, // HORIZONTAL SCAN LINE-7
+  { 0x23BD, 0x14 }, // HORIZONTAL SCAN LINE-9
+  { 0x251C, 0x15 }, // BOX DRAWINGS LIGHT VERTICAL AND RIGHT
+  { 0x2524, 0x16 }, // BOX DRAWINGS LIGHT VERTICAL AND LEFT
+  { 0x2534, 0x17 }, // BOX DRAWINGS LIGHT UP AND HORIZONTAL
+  { 0x252C, 0x18 }, // BOX DRAWINGS LIGHT DOWN AND HORIZONTAL
+  { 0x2502, 0x19 }, // BOX DRAWINGS LIGHT VERTICAL
+  { 0x2A7D, 0x1a }, // LESS-THAN OR SLANTED EQUAL-TO
+  { 0x2A7E, 0x1b }, // GREATER-THAN OR SLANTED EQUAL-TO
+  { 0x03C0, 0x1c }, // GREEK SMALL LETTER PI
+  { 0x2260, 0x1d }, // NOT EQUAL TO
+  { 0x00A3, 0x1e }, // POUND SIGN
+  { 0x00B7, 0x1f }, // MIDDLE DOT
+
+  // Other box drawing characters are shown with the light lines
+  { 0x2501, 0x12 }, // BOX DRAWINGS HEAVY HORIZONTAL
+  { 0x2503, 0x19 }, // BOX DRAWINGS HEAVY VERTICAL
+  { 0x250F, 0x0d }, // BOX DRAWINGS HEAVY DOWN AND RIGHT
+  { 0x2513, 0x0c }, // BOX DRAWINGS HEAVY DOWN AND LEFT
+  { 0x2517, 0x0e }, // BOX DRAWINGS HEAVY UP AND RIGHT
+  { 0x251B, 0x0b }, // BOX DRAWINGS HEAVY UP AND LEFT
+  { 0x2523, 0x15 }, // BOX DRAWINGS HEAVY VERTICAL AND RIGHT
+  { 0x252B, 0x16 }, // BOX DRAWINGS HEAVY VERTICAL AND LEFT
+  { 0x2533, 0x18 }, // BOX DRAWINGS HEAVY DOWN AND HORIZONTAL
+  { 0x253B, 0x17 }, // BOX DRAWINGS HEAVY UP AND HORIZONTAL
+  { 0x254B, 0x0f }, // BOX DRAWINGS HEAVY VERTICAL AND HORIZONTAL
+  { 0x2550, 0x12 }, // BOX DRAWINGS DOUBLE HORIZONTAL
+  { 0x2551, 0x19 }, // BOX DRAWINGS DOUBLE VERTICAL
+  { 0x2554, 0x0d }, // BOX DRAWINGS DOUBLE DOWN AND RIGHT
+  { 0x2557, 0x0c }, // BOX DRAWINGS DOUBLE DOWN AND LEFT
+  { 0x255A, 0x0e }, // BOX DRAWINGS DOUBLE UP AND RIGHT
+  { 0x255D, 0x0b }, // BOX DRAWINGS DOUBLE UP AND LEFT
+  { 0x2560, 0x15 }, // BOX DRAWINGS DOUBLE VERTICAL AND RIGHT
+  { 0x2563, 0x16 }, // BOX DRAWINGS DOUBLE VERTICAL AND LEFT
+  { 0x2566, 0x18 }, // BOX DRAWINGS DOUBLE DOWN AND HORIZONTAL
+  { 0x2569, 0x17 }, // BOX DRAWINGS DOUBLE UP AND HORIZONTAL
+  { 0x256C, 0x0f }, // BOX DRAWINGS DOUBLE VERTICAL AND HORIZONTAL
+  { 0x256D, 0x0d }, // BOX DRAWINGS LIGHT ARC DOWN AND RIGHT
+  { 0x256E, 0x0c }, // BOX DRAWINGS LIGHT ARC DOWN AND LEFT
+  { 0x256F, 0x0b }, // BOX DRAWINGS LIGHT ARC UP AND LEFT
+  { 0x2570, 0x0e }, // BOX DRAWINGS LIGHT ARC UP AND RIGHT
+  { 0x2591, 0x02 }, // LIGHT SHADE
+  { 0x2593, 0x02 }, // DARK SHADE
+  { 0x25C7, 0x01 }, // WHITE DIAMOND
+  { 0x2666, 0x01 }, // BLACK DIAMOND SUIT
+
+  // DEC Supplemental Graphics differs from Latin-1 in a few positions
+  // which are reserved or hold other characters.  Latin-1 characters
+  // without a glyph are shown with a similar one.
+  { 0x00A0, 0x00 }, // NO-BREAK SPACE
+  { 0x00A4, 0xa8 }, // CURRENCY SIGN
+  { 0x00A6, '|' },  // BROKEN BAR
+  { 0x00A8, '"' },  // DIAERESIS
+  { 0x00AC, '-' },  // NOT SIGN
+  { 0x00AD, '-' },  // SOFT HYPHEN
+  { 0x00AE, UnicodeMap::unknown }, // REGISTERED SIGN
+  { 0x00AF, '-' },  // MACRON
+  { 0x00B4, '\'' }, // ACUTE ACCENT
+  { 0x00B8, ',' },  // CEDILLA
+  { 0x00BE, UnicodeMap::unknown }, // VULGAR FRACTION THREE QUARTERS
+  { 0x00D0, 'D' },  // LATIN CAPITAL LETTER ETH
+  { 0x00D7, 'x' },  // MULTIPLICATION SIGN
+  { 0x00DD, 'Y' },  // LATIN CAPITAL LETTER Y WITH ACUTE
+  { 0x00DE, UnicodeMap::unknown }, // LATIN CAPITAL LETTER THORN
+  { 0x00F0, 'd' },  // LATIN SMALL LETTER ETH
+  { 0x00F7, UnicodeMap::unknown }, // DIVISION SIGN
+  { 0x00FD, 'y' },  // LATIN SMALL LETTER Y WITH ACUTE
+  { 0x00FE, UnicodeMap::unknown }, // LATIN SMALL LETTER THORN
+  { 0x00FF, 0xfd }, // LATIN SMALL LETTER Y WITH DIAERESIS
+  { 0x0152, 0xd7 }, // LATIN CAPITAL LIGATURE OE
+  { 0x0153, 0xf7 }, // LATIN SMALL LIGATURE OE
+  { 0x0178, 0xdd }, // LATIN CAPITAL LETTER Y WITH DIAERESIS
+
+  // National replacement sets that are not in Latin-1 (Dutch)
+  { 0x0133, 'y' },  // LATIN SMALL LIGATURE IJ
+  { 0x0192, 'f' },  // LATIN SMALL LETTER F WITH HOOK
+
+  // DEC Technical characters that are in the font
+  { 0x03BC, 0xb5 }, // GREEK SMALL LETTER MU
+  { 0x2212, '-' },  // MINUS SIGN
+  { 0x2264, 0x1a }, // LESS-THAN OR EQUAL TO
+  { 0x2265, 0x1b }, // GREATER-THAN OR EQUAL TO
+
+  // Punctuation that is commonly used in place of ASCII
+  { 0x2010, '-' },  // HYPHEN
+  { 0x2013, '-' },  // EN DASH
+  { 0x2014, '-' },  // EM DASH
+  { 0x2018, '`' },  // LEFT SINGLE QUOTATION MARK
+  { 0x2019, '\'' }, // RIGHT SINGLE QUOTATION MARK
+  { 0x201C, '"' },  // LEFT DOUBLE QUOTATION MARK
+  { 0x201D, '"' },  // RIGHT DOUBLE QUOTATION MARK
+  { 0x2022, 0x1f }, // BULLET
+};
+
+static constexpr unsigned
+count_pages()
+{
+  bool used[0x100] {};
+  unsigned pages = 1;
+  for (const Mapping& mapping : mappings) {
+    if (!used[mapping._code >> 8]) {
+      used[mapping._code >> 8] = true;
+      pages++;
+    }
+  }
+  // Latin-1 always has a page
+  return used[0] ? pages : (pages + 1);
+}
+
+static constexpr auto tables = [] {
+  struct {
+    uint8_t _page_index[0x101];
+    uint8_t _pages[count_pages()][256];
+  } tables {};
+
+  // Page 0 is shared by all code points without a glyph
+  for (unsigned i = 0; i < 256; i++) {
+    tables._pages[0][i] = UnicodeMap::unknown;
+  }
+
+  // Latin-1 maps to the same positions unless listed
+  tables._page_index[0] = 1;
+  for (unsigned i = 0; i < 256; i++) {
+    tables._pages[1][i] = i;
+  }
+  unsigned pages = 2;
+
+  for (const Mapping& mapping : mappings) {
+    const unsigned page = mapping._code >> 8;
+    if (!tables._page_index[page]) {
+      tables._page_index[page] = pages;
+      for (unsigned i = 0; i < 256; i++) {
+        tables._pages[pages][i] = UnicodeMap::unknown;
+      }
+      pages++;
+    }
+    tables._pages[tables._page_index[page]][mapping._code & 0xff] = mapping._dec;
+  }
+  return tables;
+}();
+
+const uint8_t* const UnicodeMap::_page_index = tables._page_index;
+const uint8_t* const UnicodeMap::_pages = &tables._pages[0][0];
@@ -0,0 +1,39 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+using namespace std;
+
+// Translation of the Unicode characters that libvterm stores in the
+// screen cells to positions in the VT220 font.  The font contains the
+// DEC Special Graphics set in positions 0x00 to 0x1f, ASCII, pictures
+// of the C1 control characters and the DEC Supplemental Graphics set
+// in the upper half.  Characters of the national replacement sets and
+// the DEC Technical set are shown with these glyphs where possible.
+//
+// The translation is a two level lookup through tables that are built
+// at compile time: The upper bits of the code point select a page of
+// 256 entries, and all code points without a glyph share one page.
+class UnicodeMap
+{
+public:
+  // Shown for characters that are not in the font
+  static constexpr uint8_t unknown = 0xff;
+
+  static uint8_t
+  to_dec_char(uint32_t code)
+  {
+    return _pages[_page_index[min<uint32_t>(code >> 8, PAGES)] * 256 + (code & 0xff)];
+  }
+
+private:
+  // Code points up to U+FFFF are mapped, higher ones use the last
+  // entry of the page index, which selects the page without glyphs.
+  static constexpr unsigned PAGES = 0x100;
+
+  static const uint8_t* const _page_index;
+  static const uint8_t* const _pages;
+};
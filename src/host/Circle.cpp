@@ -0,0 +1,254 @@
+
+// Implementation of the circle stand-ins used by the host build
+
+#include <cstdio>
+#include <cstring>
+
+#include <chrono>
+#include <thread>
+
+#include <circle/bcmframebuffer.h>
+#include <circle/devicenameservice.h>
+#include <circle/dmachannel.h>
+#include <circle/logger.h>
+#include <circle/timer.h>
+
+using namespace std;
+
+CLogger* CLogger::s_pThis = nullptr;
+CTimer* CTimer::s_pThis = nullptr;
+CBcmFrameBuffer* CBcmFrameBuffer::s_pThis = nullptr;
+
+CLogger::CLogger(unsigned nLogLevel, __unused CTimer* pTimer)
+  : m_nLogLevel(nLogLevel)
+{
+  s_pThis = this;
+}
+
+CLogger::~CLogger()
+{
+  s_pThis = nullptr;
+}
+
+void
+CLogger::Write(const char* pSource, TLogSeverity Severity, const char* pMessage, ...)
+{
+  va_list vl;
+  va_start(vl, pMessage);
+  WriteV(pSource, Severity, pMessage, vl);
+  va_end(vl);
+}
+
+void
+CLogger::WriteV(const char* pSource, TLogSeverity Severity, const char* pMessage, va_list Args)
+{
+  if (static_cast<unsigned>(Severity) > m_nLogLevel) {
+    return;
+  }
+  fprintf(stderr, "%s: ", pSource);
+  vfprintf(stderr, pMessage, Args);
+  fputc('\n', stderr);
+}
+
+static u64
+host_microseconds()
+{
+  return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+CTimer::CTimer(__unused void* pInterruptSystem)
+  : m_nStartTime(host_microseconds()),
+    m_bFrozen(FALSE),
+    m_nFrozenTime(0),
+    m_hNextTimer(1)
+{
+  s_pThis = this;
+}
+
+CTimer::~CTimer()
+{
+  s_pThis = nullptr;
+}
+
+u64
+CTimer::Now() const
+{
+  return m_bFrozen ? m_nFrozenTime : host_microseconds();
+}
+
+unsigned
+CTimer::GetTicks() const
+{
+  return (Now() - m_nStartTime) / (1000000 / HZ);
+}
+
+unsigned
+CTimer::GetClockTicks() const
+{
+  return Now() - m_nStartTime;
+}
+
+void
+CTimer::Freeze()
+{
+  m_nFrozenTime = Now();
+  m_bFrozen = TRUE;
+}
+
+void
+CTimer::Advance(unsigned nMicroSeconds)
+{
+  const u64 nTarget = m_nFrozenTime + nMicroSeconds;
+
+  // Timers fire in the order in which they elapse, with the clock set
+  // to the time at which they do.
+  while (true) {
+    auto pNext = m_KernelTimers.end();
+    for (auto pTimer = m_KernelTimers.begin(); pTimer != m_KernelTimers.end(); pTimer++) {
+      if (pTimer->m_nElapsesAt <= nTarget
+          && (pNext == m_KernelTimers.end() || pTimer->m_nElapsesAt < pNext->m_nElapsesAt)) {
+        pNext = pTimer;
+      }
+    }
+    if (pNext == m_KernelTimers.end()) {
+      break;
+    }
+    const KernelTimer Timer = *pNext;
+    m_KernelTimers.erase(pNext);
+    m_nFrozenTime = max(m_nFrozenTime, Timer.m_nElapsesAt);
+    (*Timer.m_pHandler)(Timer.m_hTimer, Timer.m_pParam, Timer.m_pContext);
+  }
+
+  m_nFrozenTime = nTarget;
+}
+
+TKernelTimerHandle
+CTimer::StartKernelTimer(unsigned nDelay,
+                         TKernelTimerHandler* pHandler,
+                         void* pParam,
+                         void* pContext)
+{
+  const TKernelTimerHandle hTimer = m_hNextTimer++;
+  m_KernelTimers.push_back(KernelTimer { hTimer, Now() + nDelay * (1000000 / HZ), pHandler, pParam, pContext });
+  return hTimer;
+}
+
+void
+CTimer::CancelKernelTimer(TKernelTimerHandle hTimer)
+{
+  for (auto pTimer = m_KernelTimers.begin(); pTimer != m_KernelTimers.end(); pTimer++) {
+    if (pTimer->m_hTimer == hTimer) {
+      m_KernelTimers.erase(pTimer);
+      return;
+    }
+  }
+}
+
+void
+CTimer::Thaw()
+{
+  if (m_bFrozen) {
+    m_nStartTime += host_microseconds() - m_nFrozenTime;
+    m_bFrozen = FALSE;
+  }
+}
+
+void
+CTimer::SimpleusDelay(unsigned nMicroSeconds)
+{
+  this_thread::sleep_for(chrono::microseconds(nMicroSeconds));
+}
+
+void
+CDMAChannel::SetupMemCopy(void* pDestination, const void* pSource, size_t nLength,
+                          __unused unsigned nBurstLength, __unused boolean bCached)
+{
+  SetupMemCopy2D(pDestination, pSource, nLength, 1, 0, 0);
+}
+
+void
+CDMAChannel::SetupMemCopy2D(void* pDestination, const void* pSource,
+                            size_t nBlockLength, unsigned nBlockCount,
+                            size_t nBlockStride, size_t nSourceBlockStride,
+                            __unused boolean bCached)
+{
+  m_pDestination = static_cast<u8*>(pDestination);
+  m_pSource = static_cast<const u8*>(pSource);
+  m_nBlockLength = nBlockLength;
+  m_nBlockCount = nBlockCount;
+  m_nBlockStride = nBlockStride;
+  m_nSourceBlockStride = nSourceBlockStride;
+}
+
+void
+CDMAChannel::Start()
+{
+  u8* pDestination = m_pDestination;
+  const u8* pSource = m_pSource;
+  for (unsigned i = 0; i < m_nBlockCount; i++) {
+    memcpy(pDestination, pSource, m_nBlockLength);
+    pDestination += m_nBlockLength + m_nBlockStride;
+    pSource += m_nBlockLength + m_nSourceBlockStride;
+  }
+}
+
+CBcmFrameBuffer::CBcmFrameBuffer(unsigned nWidth, unsigned nHeight, unsigned nDepth,
+                                 unsigned nVirtualWidth, unsigned nVirtualHeight)
+  : m_nWidth(nWidth),
+    m_nHeight(nHeight),
+    m_nVirtualWidth(nVirtualWidth ? nVirtualWidth : nWidth),
+    m_nVirtualHeight(nVirtualHeight ? nVirtualHeight : nHeight),
+    m_nDepth(nDepth),
+    m_nPitch(0),
+    m_nOffsetX(0),
+    m_nOffsetY(0),
+    m_pBuffer(nullptr),
+    m_nPaletteUpdates(0),
+    m_nOffsetUpdates(0)
+{
+  memset(m_Palette, 0, sizeof m_Palette);
+  s_pThis = this;
+}
+
+CBcmFrameBuffer::~CBcmFrameBuffer()
+{
+  s_pThis = nullptr;
+  delete[] m_pBuffer;
+}
+
+boolean
+CBcmFrameBuffer::Initialize()
+{
+  if (m_nDepth != 8) {
+    return FALSE;
+  }
+  m_nPitch = m_nVirtualWidth;
+  m_pBuffer = new u8[GetSize()]();
+  return TRUE;
+}
+
+boolean
+CBcmFrameBuffer::SetVirtualOffset(unsigned nOffsetX, unsigned nOffsetY)
+{
+  if (nOffsetX + m_nWidth > m_nVirtualWidth || nOffsetY + m_nHeight > m_nVirtualHeight) {
+    return FALSE;
+  }
+  m_nOffsetX = nOffsetX;
+  m_nOffsetY = nOffsetY;
+  m_nOffsetUpdates++;
+  return TRUE;
+}
+
+boolean
+CBcmFrameBuffer::UpdatePalette()
+{
+  m_nPaletteUpdates++;
+  return TRUE;
+}
+
+CDeviceNameService*
+CDeviceNameService::Get()
+{
+  static CDeviceNameService device_name_service;
+  return &device_name_service;
+}
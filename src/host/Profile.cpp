@@ -0,0 +1,24 @@
+
+#include <cstring>
+
+#include "Profile.h"
+
+uint64_t Profile::_nanoseconds[Profile::Stages];
+uint64_t Profile::_bytes_received;
+uint64_t Profile::_cells_rendered;
+uint64_t Profile::_cells_skipped;
+uint64_t Profile::_frames_rendered;
+uint64_t Profile::_moves_skipped;
+
+ProfileScope* ProfileScope::_current;
+
+void
+Profile::reset()
+{
+  memset(_nanoseconds, 0, sizeof _nanoseconds);
+  _bytes_received = 0;
+  _cells_rendered = 0;
+  _cells_skipped = 0;
+  _frames_rendered = 0;
+  _moves_skipped = 0;
+}
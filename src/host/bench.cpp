@@ -0,0 +1,866 @@
+
+// Host benchmark for the Terminal -> libvterm -> Framebuffer pipeline.
+//
+// Runs canned byte streams (and any files named on the command line)
+// through a Terminal connected to the in-memory circle stand-ins and
+// reports the sustained throughput and where the time was spent.
+// Scrolling moves pixels instead of rendering the cells again, so the
+// beginning of each stream is also checked against full redraws.
+// Finally, the glyph rasterizer is compared with the byte per pixel
+// rendering loop that it replaced, and keyboard autorepeat is checked
+// against the simulated clock.  The cells kept by the terminal from
+// libvterm's state layer are compared with libvterm's screen layer, and
+// a captured session is played back.
+//
+// With --replay FILE, the capture in FILE is played back at maximum
+// speed instead.
+
+#include <cstdio>
+#include <cstring>
+
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <circle/bcmframebuffer.h>
+#include <circle/logger.h>
+#include <circle/timer.h>
+
+#include "Counters.h"
+#include "Font.h"
+#include "Terminal.h"
+#include "Profile.h"
+
+using namespace std;
+
+struct Stream
+{
+  string _name;
+  string _data;
+};
+
+class Random
+{
+public:
+  Random(uint32_t seed) : _state(seed) {}
+
+  uint32_t operator()(uint32_t limit) {
+    _state = _state * 1103515245 + 12345;
+    return (_state >> 8) % limit;
+  }
+
+private:
+  uint32_t _state;
+};
+
+static const char* const words[] = {
+  "the", "terminal", "renders", "each", "character", "cell", "into", "a",
+  "frame", "buffer", "using", "glyphs", "from", "VT220", "font", "while",
+  "serial", "input", "is", "parsed", "by", "libvterm", "and", "damage",
+  "callbacks", "update", "screen", "rows", "columns", "quickly", "DMA"
+};
+
+// `cat` of a large text file: long, wrapping lines
+static Stream
+make_cat_stream(size_t size)
+{
+  Random random(1);
+  Stream stream { "cat", "" };
+  while (stream._data.size() < size) {
+    unsigned length = random(160);
+    string line;
+    while (line.size() < length) {
+      line += words[random(sizeof words / sizeof words[0])];
+      line += ' ';
+    }
+    stream._data += line + "\r\n";
+  }
+  return stream;
+}
+
+// `top`-style full screen redraws
+static Stream
+make_top_stream(size_t size)
+{
+  Random random(2);
+  Stream stream { "top", "" };
+  char line[128];
+  while (stream._data.size() < size) {
+    stream._data += "\x1b[H";
+    snprintf(line, sizeof line, "top - 12:%02u:%02u up 3 days, load average: 0.%02u, 0.%02u, 0.%02u\x1b[K\r\n",
+             random(60), random(60), random(100), random(100), random(100));
+    stream._data += line;
+    snprintf(line, sizeof line, "Tasks: %3u total, %2u running, %3u sleeping\x1b[K\r\n\x1b[K\r\n",
+             random(300), random(10), random(300));
+    stream._data += line;
+    stream._data += "\x1b[7m  PID USER      PR  NI    VIRT    RES  %CPU %MEM     TIME+ COMMAND          \x1b[m\x1b[K\r\n";
+    for (unsigned i = 0; i < 24; i++) {
+      snprintf(line, sizeof line, "%5u %-8s  20   0 %7u %6u %5.1f %4.1f %3u:%02u.%02u %-16s\x1b[K\r\n",
+               random(32768), words[random(sizeof words / sizeof words[0])], random(9999999), random(999999),
+               random(1000) / 10.0, random(1000) / 10.0, random(100), random(60), random(100),
+               words[random(sizeof words / sizeof words[0])]);
+      stream._data += line;
+    }
+    stream._data += "\x1b[J";
+  }
+  return stream;
+}
+
+// Tailing a log file: short lines, every one of them scrolls the screen
+static Stream
+make_log_stream(size_t size)
+{
+  Random random(3);
+  // The levels are shown in the ANSI colors and the timestamps in a
+  // gray of the 256 color palette, like colorizing loggers do
+  static const char* const levels[] = {
+    "\x1b[36mDEBUG\x1b[39m",
+    "\x1b[32mINFO \x1b[39m",
+    "\x1b[33mWARN \x1b[39m",
+    "\x1b[1;37;41mERROR\x1b[m"
+  };
+  Stream stream { "log", "" };
+  char line[160];
+  while (stream._data.size() < size) {
+    snprintf(line, sizeof line, "\x1b[38;5;244m2026-10-17 12:%02u:%02u.%03u\x1b[39m %s [worker-%u] request %u completed in %u ms\r\n",
+             random(60), random(60), random(1000), levels[random(4)], random(16), random(100000), random(1000));
+    stream._data += line;
+  }
+  return stream;
+}
+
+// Editing in a full screen editor: lines and characters are inserted
+// and deleted, which moves parts of the screen in all directions
+static Stream
+make_edit_stream(size_t size)
+{
+  Random random(4);
+  Stream stream { "edit", "" };
+  char sequence[64];
+  while (stream._data.size() < size) {
+    const unsigned row = random(23) + 1;
+    snprintf(sequence, sizeof sequence, "\x1b[%u;%uH", row, random(80) + 1);
+    stream._data += sequence;
+    switch (random(9)) {
+    case 0:
+      snprintf(sequence, sizeof sequence, "\x1b[%uL", random(4) + 1);
+      break;
+    case 1:
+      snprintf(sequence, sizeof sequence, "\x1b[%uM", random(4) + 1);
+      break;
+    case 2:
+      snprintf(sequence, sizeof sequence, "\x1b[%u@", random(10) + 1);
+      break;
+    case 3:
+      snprintf(sequence, sizeof sequence, "\x1b[%uP", random(10) + 1);
+      break;
+    case 4:
+      // Scroll a region down by one line
+      snprintf(sequence, sizeof sequence, "\x1b[%u;%ur\x1b[%uH\x1bM\x1b[r", row, row + random(24 - row) + 1, row);
+      break;
+    case 5:
+      // Scroll a region up by one line
+      snprintf(sequence, sizeof sequence, "\x1b[%u;%ur\x1b[%uH\x1b" "D\x1b[r", row - random(row), row, row);
+      break;
+    case 6:
+      snprintf(sequence, sizeof sequence, "\x1b#%c", random(2) ? '6' : '5');
+      break;
+    default:
+      // Scroll the whole screen down by one line
+      snprintf(sequence, sizeof sequence, "\x1b[H\x1bM");
+      break;
+    }
+    stream._data += sequence;
+    for (unsigned i = random(6); i; i--) {
+      stream._data += words[random(sizeof words / sizeof words[0])];
+      stream._data += ' ';
+    }
+  }
+  return stream;
+}
+
+// The streams are sent like by a host that obeys RTS/CTS, which the
+// terminal does not use unless it is switched on
+struct BenchSerialPort
+  : public SerialPort
+{
+  BenchSerialPort()
+    : SerialPort(nullptr)
+  {
+    set_flow_control(Hardware);
+  }
+};
+
+static bool
+read_stream(const char* filename, Stream& stream)
+{
+  ifstream input(filename, ios::binary);
+  if (!input) {
+    return false;
+  }
+  stream._name = filename;
+  stream._data.assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+  return true;
+}
+
+// Feeds the stream in small pieces and compares the frame buffer after
+// each of them with what a redraw of the whole screen produces.  The
+// borders above and below the text area must stay blank.
+static bool
+verify(const Stream& stream)
+{
+  BenchSerialPort serial;
+  Terminal terminal(&serial);
+  CBcmFrameBuffer* frame_buffer = CBcmFrameBuffer::Get();
+  const size_t size = frame_buffer->GetPitch() * frame_buffer->GetHeight();
+  const size_t border = (frame_buffer->GetHeight() % Framebuffer::font_height()) / 2 * frame_buffer->GetPitch();
+
+  const size_t length = min<size_t>(stream._data.size(), 64 * 1024);
+  const size_t piece = 256;
+  for (size_t offset = 0; offset < length; offset += piece) {
+    serial.feed(stream._data.data() + offset, min(piece, length - offset));
+    while (serial.available()) {
+      terminal.process();
+    }
+
+    const u8* pixels = reinterpret_cast<const u8*>(frame_buffer->GetDisplayed());
+    const string screen(pixels, pixels + size);
+    terminal.redraw();
+    terminal.process();
+    pixels = reinterpret_cast<const u8*>(frame_buffer->GetDisplayed());
+    if (screen != string(pixels, pixels + size)
+        || screen.find_first_not_of('\0') < border
+        || (screen.find_last_not_of('\0') != string::npos
+            && screen.find_last_not_of('\0') >= size - border)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// With a frame rate, the terminal renders at that rate while input
+// keeps arriving, so the clock runs during the measurement.  Without
+// one, every chunk of input is rendered.
+static bool
+run(const Stream& stream, unsigned frame_rate, bool exact)
+{
+  BenchSerialPort serial;
+  Terminal terminal(&serial);
+  terminal.set_frame_rate(frame_rate);
+  Profile::reset();
+  serial.feed(stream._data.data(), stream._data.size());
+  const unsigned palette_updates = Counters::get(Counters::PaletteUpdates);
+
+  CTimer::Get()->Thaw();
+  auto start = chrono::steady_clock::now();
+  while (serial.available()) {
+    terminal.process();
+  }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  auto ms = [](uint64_t nanoseconds) { return nanoseconds / 1e6; };
+  double parse = ms(Profile::_nanoseconds[Profile::Parse]);
+  double render = ms(Profile::_nanoseconds[Profile::Render]);
+  double blit = ms(Profile::_nanoseconds[Profile::Blit]);
+  double bytes_per_second = Profile::_bytes_received / seconds;
+  double palette_updates_per_second = (Counters::get(Counters::PaletteUpdates) - palette_updates) / seconds;
+  const uint64_t damaged = Profile::_cells_rendered + Profile::_cells_skipped;
+  double skipped = damaged ? 100.0 * Profile::_cells_skipped / damaged : 0;
+  CTimer::Get()->Freeze();
+
+  const string fps = frame_rate ? to_string(frame_rate) : "-";
+  printf("%-12s %4s %9llu %8.3f %11.0f %11.0f %7.1f%% %10.0f %7llu %9.0f %9.1f %9.1f %9.1f %7s\n",
+         stream._name.c_str(),
+         fps.c_str(),
+         (unsigned long long) Profile::_bytes_received,
+         seconds,
+         bytes_per_second,
+         Profile::_cells_rendered / seconds,
+         skipped,
+         bytes_per_second * 10,            // 8N1: ten bits per byte
+         (unsigned long long) Profile::_frames_rendered,
+         palette_updates_per_second,
+         parse, render, blit,
+         exact ? "exact" : "differ");
+
+  return exact;
+}
+
+// Feeds the beginning of the stream in pieces to a terminal that keeps
+// the cells in the given layer, and records the frame buffer after each
+// of them.  The time to process the whole stream is measured as well.
+static vector<size_t>
+layer_screens(const Stream& stream, Terminal::Layer layer, double& milliseconds)
+{
+  vector<size_t> screens;
+  {
+    BenchSerialPort serial;
+    Terminal terminal(&serial, layer);
+    CBcmFrameBuffer* frame_buffer = CBcmFrameBuffer::Get();
+    const size_t size = frame_buffer->GetPitch() * frame_buffer->GetHeight();
+    const size_t length = min<size_t>(stream._data.size(), 64 * 1024);
+    const size_t piece = 256;
+    for (size_t offset = 0; offset < length; offset += piece) {
+      serial.feed(stream._data.data() + offset, min(piece, length - offset));
+      while (serial.available()) {
+        terminal.process();
+      }
+      const char* pixels = reinterpret_cast<const char*>(frame_buffer->GetDisplayed());
+      screens.push_back(hash<string_view>()(string_view(pixels, size)));
+    }
+  }
+
+  BenchSerialPort serial;
+  Terminal terminal(&serial, layer);
+  terminal.set_frame_rate(0);
+  serial.feed(stream._data.data(), stream._data.size());
+  auto start = chrono::steady_clock::now();
+  while (serial.available()) {
+    terminal.process();
+  }
+  milliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+  return screens;
+}
+
+static bool
+compare_layers(const vector<Stream>& streams)
+{
+  printf("\n%-12s %9s %9s %7s\n", "layers", "state ms", "screen ms", "pixels");
+  bool same = true;
+  for (auto& stream : streams) {
+    double state_ms;
+    double screen_ms;
+    const bool stream_same = layer_screens(stream, Terminal::Layer::State, state_ms)
+      == layer_screens(stream, Terminal::Layer::Screen, screen_ms);
+    printf("%-12s %9.1f %9.1f %7s\n", stream._name.c_str(), state_ms, screen_ms, stream_same ? "same" : "differ");
+    same = stream_same && same;
+  }
+  return same;
+}
+
+// Defined in Keyboard.cpp, called by the USB keyboard driver
+void handle_report_stub(unsigned char modifiers, const unsigned char keys[6]);
+
+// Holds the A key for the given time and returns the number of
+// characters sent.  With the default typematic settings, the key
+// repeats after 500 ms at 30 characters per second.
+static size_t
+hold_key(const char* setup, unsigned milliseconds)
+{
+  static const unsigned char a[6] = { 0x04, 0, 0, 0, 0, 0 };
+  static const unsigned char none[6] = { 0, 0, 0, 0, 0, 0 };
+
+  BenchSerialPort serial;
+  Terminal terminal(&serial);
+  serial.feed(setup, strlen(setup));
+  terminal.process();
+
+  handle_report_stub(0, a);
+  terminal.process();
+  // Rendering takes its time, but repetitions are sent by the timer
+  for (unsigned i = 0; i < milliseconds; i += 10) {
+    CTimer::Get()->Advance(10000);
+    terminal.redraw();
+    terminal.process();
+  }
+  handle_report_stub(0, none);
+  terminal.process();
+  CTimer::Get()->Advance(1000000);
+
+  return serial.bytes_written();
+}
+
+static bool
+check_autorepeat()
+{
+  struct {
+    const char* _name;
+    const char* _setup;
+    unsigned _milliseconds;
+    size_t _expected;
+  } cases[] = {
+    { "tap", "", 100, 1 },
+    { "hold 1.5s", "", 1500, 1 + 31 },
+    { "hold 10s", "", 10000, 1 + 286 },
+    { "DECARM off", "\x1b[?8l", 1500, 1 },
+    { "DECARM on", "\x1b[?8l\x1b[?25;8h", 1500, 1 + 31 },
+  };
+
+  printf("\n%-12s %8s %8s %7s\n", "autorepeat", "held ms", "chars", "result");
+  bool correct = true;
+  for (auto& c : cases) {
+    const size_t sent = hold_key(c._setup, c._milliseconds);
+    printf("%-12s %8u %8zu %7s\n", c._name, c._milliseconds, sent, sent == c._expected ? "ok" : "wrong");
+    correct = correct && sent == c._expected;
+  }
+  return correct;
+}
+
+// Fills the screen with text, with the cursor hidden
+static string
+full_screen()
+{
+  string text("\x1b[?25l");
+  for (unsigned row = 0; row < 24; row++) {
+    text += string(80, 'x');
+    if (row < 23) {
+      text += "\r\n";
+    }
+  }
+  return text;
+}
+
+static unsigned
+glyphs_rendered()
+{
+  return Counters::get(Counters::GlyphHits) + Counters::get(Counters::GlyphMisses);
+}
+
+struct EraseCost {
+  unsigned _glyphs;
+  unsigned _transfers;
+};
+
+// Fills the screen with text, then erases parts of it and returns the
+// number of glyphs rendered and DMA transfers queued for the erase.
+// Erased cells are filled rather than rendered, and fills of whole rows
+// are combined.  Small transfers are done by the CPU if no others are
+// pending, they are not counted.
+static EraseCost
+erase_cost(const char* sequence)
+{
+  BenchSerialPort serial;
+  Terminal terminal(&serial);
+  const string text = full_screen();
+  serial.feed(text.data(), text.size());
+  while (serial.available()) {
+    terminal.process();
+  }
+
+  const EraseCost before { glyphs_rendered(), Counters::get(Counters::DMATransfers) };
+  serial.feed(sequence, strlen(sequence));
+  while (serial.available()) {
+    terminal.process();
+  }
+  return EraseCost { glyphs_rendered() - before._glyphs, Counters::get(Counters::DMATransfers) - before._transfers };
+}
+
+static bool
+check_erase()
+{
+  struct {
+    const char* _name;
+    const char* _sequence;
+    EraseCost _expected;
+  } cases[] = {
+    { "clear", "\x1b[2J", { 0, 1 } },
+    { "clear+cursor", "\x1b[?25h\x1b[H\x1b[2J", { 1, 2 } },
+    { "erase below", "\x1b[12H\x1b[J", { 0, 1 } },
+    { "erase line", "\x1b[5H\x1b[2K", { 0, 1 } },
+  };
+
+  printf("\n%-12s %8s %9s %7s\n", "erase", "glyphs", "transfers", "result");
+  bool correct = true;
+  for (auto& c : cases) {
+    const EraseCost cost = erase_cost(c._sequence);
+    const bool ok = cost._glyphs <= c._expected._glyphs && cost._transfers <= c._expected._transfers;
+    printf("%-12s %8u %9u %7s\n", c._name, cost._glyphs, cost._transfers, ok ? "ok" : "wrong");
+    correct = correct && ok;
+  }
+  return correct;
+}
+
+// Fills that are queued while a span of glyphs is being collected can
+// take up more than a batch.  The glyphs must still be copied from
+// memory that is valid when their transfer runs.
+static bool
+check_staging()
+{
+  auto top_row = [](unsigned fills) {
+    Framebuffer framebuffer;
+    CBcmFrameBuffer* frame_buffer = CBcmFrameBuffer::Get();
+    framebuffer.putc(0, 0, 'A', 1, 0, VTermScreenCellAttrs {});
+    for (unsigned i = 0; i < fills; i++) {
+      // Alternating colors keep the fills from being combined
+      framebuffer.fill_rect(1 + i % 20, 0, 1, framebuffer.width() / Framebuffer::font_width(), 2 + i % 2);
+    }
+    framebuffer.update();
+    const size_t border = frame_buffer->GetHeight() % Framebuffer::font_height() / 2;
+    const u8* pixels = reinterpret_cast<const u8*>(frame_buffer->GetDisplayed());
+    return string(pixels, pixels + frame_buffer->GetPitch() * (border + Framebuffer::font_height()));
+  };
+
+  const unsigned fills = 300;
+  const bool ok = top_row(0) == top_row(fills);
+  printf("\n%-12s %8s %7s\n", "staging", "fills", "result");
+  printf("%-12s %8u %7s\n", "span", fills, ok ? "ok" : "wrong");
+  return ok;
+}
+
+// A screen full of text with a few blinking cells in colors.  Each
+// change of the blink phase must render only these cells, and hide or
+// show them.
+static bool
+check_blink()
+{
+  BenchSerialPort serial;
+  Terminal terminal(&serial);
+  const string text = full_screen() + "\x1b[5;10H\x1b[5;31mALERT\x1b[m\x1b[20;60H\x1b[1;5;44mFAIL\x1b[m";
+  serial.feed(text.data(), text.size());
+  while (serial.available()) {
+    terminal.process();
+  }
+
+  CBcmFrameBuffer* frame_buffer = CBcmFrameBuffer::Get();
+  const size_t size = frame_buffer->GetPitch() * frame_buffer->GetHeight();
+  auto screen = [&] {
+    const u8* pixels = reinterpret_cast<const u8*>(frame_buffer->GetDisplayed());
+    return string(pixels, pixels + size);
+  };
+
+  const unsigned blinking = 9;
+  const unsigned phases = 4;
+  vector<string> screens { screen() };
+  const unsigned glyphs = glyphs_rendered();
+  for (unsigned i = 0; i < phases; i++) {
+    // Events run after the damage has been rendered, the cells that
+    // they mark are rendered by the next pass.
+    CTimer::Get()->Advance(500000);
+    terminal.process();
+    terminal.process();
+    screens.push_back(screen());
+  }
+  const double glyphs_per_phase = double(glyphs_rendered() - glyphs) / phases;
+
+  bool correct = glyphs_per_phase <= blinking;
+  for (unsigned i = 1; i <= phases; i++) {
+    correct = correct && screens[i] != screens[i - 1] && (i < 2 || screens[i] == screens[i - 2]);
+  }
+
+  printf("\n%-12s %8s %12s %7s\n", "blink", "cells", "glyphs/phase", "result");
+  printf("%-12s %8u %12.1f %7s\n", "", blinking, glyphs_per_phase, correct ? "ok" : "wrong");
+  return correct;
+}
+
+// Reverse video and the visual bell only rewrite the palette.  The
+// pixels must stay the same and no glyphs may be rendered, while the
+// background and text palette entries swap their colors.  Bold text
+// must look different from normal text either way.
+static bool
+check_screen_modes()
+{
+  struct {
+    const char* _name;
+    const char* _setup;
+    const char* _sequence;
+    unsigned _advance;
+    bool _inverted;
+  } cases[] = {
+    { "DECSCNM on", "", "\x1b[?5h", 0, true },
+    { "DECSCNM off", "\x1b[?5h", "\x1b[?5l", 0, true },
+    { "bell", "", "\x07", 0, true },
+    { "bell 100ms", "", "\x07", 100000, false },
+  };
+
+  printf("\n%-12s %8s %8s %8s %7s\n", "screen mode", "glyphs", "palette", "pixels", "result");
+  bool correct = true;
+  for (auto& c : cases) {
+    BenchSerialPort serial;
+    Terminal terminal(&serial);
+    const string text = full_screen() + c._setup;
+    serial.feed(text.data(), text.size());
+    while (serial.available()) {
+      terminal.process();
+    }
+
+    CBcmFrameBuffer* frame_buffer = CBcmFrameBuffer::Get();
+    const size_t size = frame_buffer->GetPitch() * frame_buffer->GetHeight();
+    const u8* pixels = reinterpret_cast<const u8*>(frame_buffer->GetDisplayed());
+    const string screen(pixels, pixels + size);
+    const u32 background = frame_buffer->GetPalette32(0);
+    const u32 text_color = frame_buffer->GetPalette32(1);
+    const unsigned glyphs = glyphs_rendered();
+    const unsigned palette_updates = frame_buffer->GetPaletteUpdates();
+
+    serial.feed(c._sequence, strlen(c._sequence));
+    while (serial.available()) {
+      terminal.process();
+    }
+    if (c._advance) {
+      CTimer::Get()->Advance(c._advance);
+      terminal.process();
+    }
+
+    pixels = reinterpret_cast<const u8*>(frame_buffer->GetDisplayed());
+    const bool same = screen == string(pixels, pixels + size);
+    const bool inverted = frame_buffer->GetPalette32(0) == text_color && frame_buffer->GetPalette32(1) == background;
+    const bool restored = frame_buffer->GetPalette32(0) == background && frame_buffer->GetPalette32(1) == text_color;
+    const bool bold = frame_buffer->GetPalette32(2) != frame_buffer->GetPalette32(1);
+    const unsigned rendered = glyphs_rendered() - glyphs;
+    const bool ok = same && rendered == 0 && (c._inverted ? inverted : restored) && bold;
+    printf("%-12s %8u %8u %8s %7s\n", c._name, rendered, frame_buffer->GetPaletteUpdates() - palette_updates,
+           same ? "same" : "differ", ok ? "ok" : "wrong");
+    correct = correct && ok;
+  }
+  return correct;
+}
+
+static string
+displayed_screen()
+{
+  CBcmFrameBuffer* frame_buffer = CBcmFrameBuffer::Get();
+  const u8* pixels = reinterpret_cast<const u8*>(frame_buffer->GetDisplayed());
+  return string(pixels, pixels + frame_buffer->GetPitch() * frame_buffer->GetHeight());
+}
+
+static const char* const capture_file = P_tmpdir "/pivt-bench.cap";
+
+// Captures the beginning of a stream that arrives over a simulated
+// second, followed by F3, which shows the new color scheme in the
+// status line, and replays it at maximum and at the original speed.
+// Both replays must end with the screen that the capture ended with,
+// the one at the original speed after as long as the capture took.
+static bool
+check_capture()
+{
+  static const unsigned char f3[6] = { 0x3c, 0, 0, 0, 0, 0 };
+  static const unsigned char none[6] = { 0, 0, 0, 0, 0, 0 };
+  const Stream stream = make_edit_stream(64 * 1024);
+  const size_t pieces = 100;
+  const unsigned interval = 10000;
+
+  string captured;
+  size_t bytes;
+  {
+    BenchSerialPort serial;
+    Terminal terminal(&serial);
+    if (!terminal.start_capture(capture_file)) {
+      return false;
+    }
+    const string data = stream._data + "\x1b[?25l";
+    const size_t piece = (data.size() + pieces - 1) / pieces;
+    for (size_t offset = 0; offset < data.size(); offset += piece) {
+      serial.feed(data.data() + offset, min(piece, data.size() - offset));
+      while (serial.available()) {
+        terminal.process();
+      }
+      CTimer::Get()->Advance(interval);
+    }
+    handle_report_stub(0, f3);
+    terminal.process();
+    handle_report_stub(0, none);
+    terminal.process();
+    terminal.stop_capture();
+    bytes = terminal.capture().bytes_written();
+    captured = displayed_screen();
+  }
+
+  auto replay = [&](bool original_speed, unsigned& duration) {
+    BenchSerialPort serial;
+    Terminal terminal(&serial);
+    duration = 0;
+    if (!terminal.start_replay(capture_file, original_speed)) {
+      return false;
+    }
+    while (terminal.replaying()) {
+      terminal.process();
+      if (original_speed) {
+        CTimer::Get()->Advance(1000);
+        duration += 1000;
+      }
+    }
+    return displayed_screen() == captured;
+  };
+  unsigned fast_duration;
+  unsigned original_duration;
+  const bool fast = replay(false, fast_duration);
+  const bool original = replay(true, original_duration);
+  remove(capture_file);
+
+  const unsigned expected = pieces * interval;
+  const bool correct = fast && original && original_duration >= expected && original_duration <= expected + 2000;
+  printf("\n%-12s %8s %10s %10s %10s %7s\n", "capture", "bytes", "fast", "original", "ms", "result");
+  printf("%-12s %8zu %10s %10s %10.1f %7s\n", "", bytes, fast ? "same" : "differ", original ? "same" : "differ",
+         original_duration / 1000.0, correct ? "ok" : "wrong");
+  return correct;
+}
+
+// Plays back a capture at maximum speed
+static bool
+replay(const char* filename)
+{
+  BenchSerialPort serial;
+  Terminal terminal(&serial);
+  if (!terminal.start_replay(filename, false)) {
+    return false;
+  }
+  const unsigned parsed = Counters::get(Counters::BytesParsed);
+  auto start = chrono::steady_clock::now();
+  while (terminal.replaying()) {
+    terminal.process();
+  }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  const unsigned bytes = Counters::get(Counters::BytesParsed) - parsed;
+  printf("%-12s %9s %8s %11s\n", "replay", "bytes", "seconds", "bytes/s");
+  printf("%-12s %9u %8.3f %11.0f\n", "", bytes, seconds, bytes / seconds);
+  return true;
+}
+
+// The rendering loop that was used with the font stored as one byte per
+// pixel
+static void
+render_bytes(const uint8_t* font,
+             uint8_t* p,
+             unsigned char c,
+             Font::Size size,
+             bool underline,
+             uint8_t foreground_color,
+             uint8_t background_color)
+{
+  const uint8_t* p_font_glyph = font + c * Font::width * Font::height;
+
+  auto get_font_data = [=](unsigned x, unsigned y) {
+    if (underline && y == (Font::height - 1)) {
+      return foreground_color;
+    } else {
+      return p_font_glyph[y * Font::width + x] ? foreground_color : background_color;
+    }
+  };
+
+  switch (size) {
+  case Font::Normal:
+    for (unsigned y = 0; y < Font::height; y++) {
+      for (unsigned x = 0; x < Font::width; x++) {
+        *p++ = get_font_data(x, y);
+      }
+    }
+    break;
+  case Font::DoubleWidth:
+    for (unsigned y = 0; y < Font::height; y++) {
+      for (unsigned x = 0; x < Font::width; x++) {
+        const uint8_t color = get_font_data(x, y);
+        *p++ = color;
+        *p++ = color;
+      }
+    }
+    break;
+  case Font::DoubleHeightTop:
+  case Font::DoubleHeightBottom:
+    for (unsigned y = (size == Font::DoubleHeightTop) ? 0 : Font::height / 2;
+         y < ((size == Font::DoubleHeightTop) ? Font::height / 2 : Font::height);
+         y++) {
+      for (unsigned i = 0; i < 2; i++) {
+        for (unsigned x = 0; x < Font::width; x++) {
+          const uint8_t color = get_font_data(x, y);
+          *p++ = color;
+          *p++ = color;
+        }
+      }
+    }
+    break;
+  }
+}
+
+static bool
+compare_rasterizers()
+{
+  vector<uint8_t> font(256 * Font::width * Font::height);
+  for (unsigned c = 0; c < 256; c++) {
+    for (unsigned y = 0; y < Font::height; y++) {
+      for (unsigned x = 0; x < Font::width; x++) {
+        font[(c * Font::height + y) * Font::width + x] = (Font::row(c, y) >> x) & 1;
+      }
+    }
+  }
+
+  const unsigned glyph_size = 2 * Font::width * Font::height;
+  vector<uint8_t> expected(glyph_size);
+  vector<uint8_t> actual(glyph_size);
+  bool same = true;
+  for (unsigned c = 0; c < 256; c++) {
+    for (auto size : { Font::Normal, Font::DoubleWidth, Font::DoubleHeightTop, Font::DoubleHeightBottom }) {
+      for (bool underline : { false, true }) {
+        render_bytes(font.data(), expected.data(), c, size, underline, 1, 0);
+        Font::render(actual.data(), c, size, underline, 1, 0);
+        same = same && expected == actual;
+      }
+    }
+  }
+
+  const unsigned rounds = 200;
+  auto time = [&](auto render) {
+    auto start = chrono::steady_clock::now();
+    for (unsigned i = 0; i < rounds; i++) {
+      for (unsigned c = 0; c < 256; c++) {
+        render(actual.data(), c, (c & 1) ? Font::Normal : Font::DoubleWidth, c & 2, 2, 1);
+      }
+    }
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / (rounds * 256);
+  };
+  const double bytes = time([&](uint8_t* p, unsigned char c, Font::Size size, bool underline, uint8_t fg, uint8_t bg) {
+    render_bytes(font.data(), p, c, size, underline, fg, bg);
+  });
+  const double packed = time(Font::render);
+
+  printf("\n%-12s %15s %15s %7s\n", "rasterizer", "bytes ns/glyph", "packed ns/glyph", "output");
+  printf("%-12s %15.1f %15.1f %7s\n", "", bytes, packed, same ? "same" : "differ");
+
+  return same;
+}
+
+int
+main(int argc, char* argv[])
+{
+  // The cursor blinks with the clock, which would make the
+  // comparison with the redrawn screen depend on timing.
+  CTimer timer;
+  timer.Freeze();
+  CLogger logger(LogWarning, &timer);
+
+  if (argc == 3 && strcmp(argv[1], "--replay") == 0) {
+    return replay(argv[2]) ? 0 : 1;
+  }
+
+  const size_t stream_size = 1 << 20;
+  vector<Stream> streams {
+    make_cat_stream(stream_size),
+    make_top_stream(stream_size),
+    make_log_stream(stream_size),
+    make_edit_stream(stream_size)
+  };
+  for (int i = 1; i < argc; i++) {
+    Stream stream;
+    if (!read_stream(argv[i], stream)) {
+      fprintf(stderr, "%s: cannot read %s\n", argv[0], argv[i]);
+      return 1;
+    }
+    streams.push_back(stream);
+  }
+
+  printf("%-12s %4s %9s %8s %11s %11s %8s %10s %7s %9s %9s %9s %9s %7s\n",
+         "stream", "fps", "bytes", "seconds", "bytes/s", "cells/s", "skipped", "max bps", "frames", "palette/s",
+         "parse ms", "render ms", "blit ms", "pixels");
+  bool exact = true;
+  for (auto& stream : streams) {
+    const bool stream_exact = verify(stream);
+    run(stream, 0, stream_exact);
+    run(stream, 60, stream_exact);
+    exact = stream_exact && exact;
+  }
+
+  exact = compare_layers(streams) && exact;
+  exact = compare_rasterizers() && exact;
+  exact = check_autorepeat() && exact;
+  exact = check_erase() && exact;
+  exact = check_staging() && exact;
+  exact = check_blink() && exact;
+  exact = check_screen_modes() && exact;
+  exact = check_capture() && exact;
+
+  return exact ? 0 : 1;
+}
@@ -0,0 +1,5 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <circle/types.h>
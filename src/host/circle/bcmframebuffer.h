@@ -0,0 +1,58 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <circle/types.h>
+
+// In-memory frame buffer.  Only 8 bits per pixel are supported.
+class CBcmFrameBuffer
+{
+public:
+  CBcmFrameBuffer(unsigned nWidth, unsigned nHeight, unsigned nDepth,
+                  unsigned nVirtualWidth = 0, unsigned nVirtualHeight = 0);
+  ~CBcmFrameBuffer();
+
+  boolean Initialize();
+
+  unsigned GetWidth() const { return m_nWidth; }
+  unsigned GetHeight() const { return m_nHeight; }
+  unsigned GetVirtWidth() const { return m_nVirtualWidth; }
+  unsigned GetVirtHeight() const { return m_nVirtualHeight; }
+  unsigned GetPitch() const { return m_nPitch; }
+  unsigned GetDepth() const { return m_nDepth; }
+  // On the device, this is a 32 bit bus address
+  uintptr_t GetBuffer() const { return reinterpret_cast<uintptr_t>(m_pBuffer); }
+  unsigned GetSize() const { return m_nPitch * m_nVirtualHeight; }
+
+  boolean SetVirtualOffset(unsigned nOffsetX, unsigned nOffsetY);
+
+  // The part of the virtual frame buffer that is displayed, GetHeight()
+  // rows starting at this address
+  uintptr_t GetDisplayed() const { return GetBuffer() + m_nOffsetY * m_nPitch + m_nOffsetX; }
+
+  void SetPalette32(u8 nIndex, u32 nRGBA) { m_Palette[nIndex] = nRGBA; }
+  boolean UpdatePalette();
+  u32 GetPalette32(u8 nIndex) const { return m_Palette[nIndex]; }
+
+  unsigned GetPaletteUpdates() const { return m_nPaletteUpdates; }
+  unsigned GetOffsetUpdates() const { return m_nOffsetUpdates; }
+
+  // The frame buffer that was created last
+  static CBcmFrameBuffer* Get() { return s_pThis; }
+
+private:
+  unsigned m_nWidth;
+  unsigned m_nHeight;
+  unsigned m_nVirtualWidth;
+  unsigned m_nVirtualHeight;
+  unsigned m_nDepth;
+  unsigned m_nPitch;
+  unsigned m_nOffsetX;
+  unsigned m_nOffsetY;
+  u8* m_pBuffer;
+  u32 m_Palette[256];
+  unsigned m_nPaletteUpdates;
+  unsigned m_nOffsetUpdates;
+
+  static CBcmFrameBuffer* s_pThis;
+};
@@ -0,0 +1,14 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <circle/types.h>
+
+class CDevice
+{
+public:
+  virtual ~CDevice() {}
+
+  virtual int Read(void* pBuffer, size_t nCount) { return -1; }
+  virtual int Write(const void* pBuffer, size_t nCount) { return -1; }
+};
@@ -0,0 +1,16 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <circle/device.h>
+#include <circle/types.h>
+
+// Devices are registered, but cannot be looked up on the host.
+class CDeviceNameService
+{
+public:
+  void AddDevice(const char* pName, CDevice* pDevice, boolean bBlockDevice) {}
+  CDevice* GetDevice(const char* pName, boolean bBlockDevice) { return nullptr; }
+
+  static CDeviceNameService* Get();
+};
@@ -0,0 +1,36 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <circle/types.h>
+
+#define DMA_CHANNEL_NORMAL 0x80
+
+// DMA channel that performs its transfers with memcpy when started.
+class CDMAChannel
+{
+public:
+  CDMAChannel(unsigned nChannel) {}
+
+  void SetupMemCopy(void* pDestination, const void* pSource, size_t nLength,
+                    unsigned nBurstLength = 0, boolean bCached = TRUE);
+
+  // Copies nBlockCount blocks of nBlockLength bytes.  nBlockStride is
+  // added to the destination and nSourceBlockStride to the source
+  // address after each block.
+  void SetupMemCopy2D(void* pDestination, const void* pSource,
+                      size_t nBlockLength, unsigned nBlockCount,
+                      size_t nBlockStride, size_t nSourceBlockStride = 0,
+                      boolean bCached = TRUE);
+
+  void Start();
+  boolean Wait() { return TRUE; }
+
+private:
+  u8* m_pDestination;
+  const u8* m_pSource;
+  size_t m_nBlockLength;
+  unsigned m_nBlockCount;
+  size_t m_nBlockStride;
+  size_t m_nSourceBlockStride;
+};
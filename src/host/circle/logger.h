@@ -0,0 +1,37 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <cstdarg>
+
+#include <circle/types.h>
+
+class CTimer;
+
+enum TLogSeverity {
+  LogPanic,
+  LogError,
+  LogWarning,
+  LogNotice,
+  LogDebug
+};
+
+// Writes log messages to stderr.
+class CLogger
+{
+public:
+  CLogger(unsigned nLogLevel, CTimer* pTimer = nullptr);
+  ~CLogger();
+
+  boolean Initialize(void* pTarget = nullptr) { return TRUE; }
+
+  void Write(const char* pSource, TLogSeverity Severity, const char* pMessage, ...);
+  void WriteV(const char* pSource, TLogSeverity Severity, const char* pMessage, va_list Args);
+
+  static CLogger* Get() { return s_pThis; }
+
+private:
+  unsigned m_nLogLevel;
+
+  static CLogger* s_pThis;
+};
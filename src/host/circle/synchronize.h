@@ -0,0 +1,18 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <atomic>
+
+#include <circle/types.h>
+
+// The host build is single threaded, so critical sections have nothing
+// to protect against.
+inline void EnterCritical() {}
+inline void LeaveCritical() {}
+
+inline void DataMemBarrier() { std::atomic_thread_fence(std::memory_order_seq_cst); }
+inline void DataSyncBarrier() { std::atomic_thread_fence(std::memory_order_seq_cst); }
+
+// There are no caches to maintain for the DMA stand-ins.
+inline void CleanAndInvalidateDataCacheRange(uintptr_t nAddress, size_t nLength) {}
@@ -0,0 +1,65 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <vector>
+
+#include <circle/types.h>
+
+#define HZ 100
+
+typedef uintptr_t TKernelTimerHandle;
+typedef void TKernelTimerHandler(TKernelTimerHandle hTimer, void* pParam, void* pContext);
+
+// Clock backed by the host's monotonic clock.  The clock can be frozen
+// to make runs reproducible, it then only moves with Advance().  Kernel
+// timers only fire while the clock is advanced.
+class CTimer
+{
+public:
+  CTimer(void* pInterruptSystem = nullptr);
+  ~CTimer();
+
+  boolean Initialize() { return TRUE; }
+
+  // Ticks (1/HZ seconds) since the timer was created
+  unsigned GetTicks() const;
+  // Microseconds since the timer was created
+  unsigned GetClockTicks() const;
+
+  void Freeze();
+  void Advance(unsigned nMicroSeconds);
+  // Lets the clock run again from where it was frozen
+  void Thaw();
+
+  // The delay is given in ticks
+  TKernelTimerHandle StartKernelTimer(unsigned nDelay,
+                                      TKernelTimerHandler* pHandler,
+                                      void* pParam = nullptr,
+                                      void* pContext = nullptr);
+  void CancelKernelTimer(TKernelTimerHandle hTimer);
+
+  static void SimpleusDelay(unsigned nMicroSeconds);
+
+  static CTimer* Get() { return s_pThis; }
+
+private:
+  u64 m_nStartTime;
+  boolean m_bFrozen;
+  u64 m_nFrozenTime;
+
+  struct KernelTimer
+  {
+    TKernelTimerHandle m_hTimer;
+    u64 m_nElapsesAt;
+    TKernelTimerHandler* m_pHandler;
+    void* m_pParam;
+    void* m_pContext;
+  };
+  std::vector<KernelTimer> m_KernelTimers;
+  TKernelTimerHandle m_hNextTimer;
+
+  u64 Now() const;
+
+  static CTimer* s_pThis;
+};
@@ -0,0 +1,19 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef bool boolean;
+#define FALSE false
+#define TRUE true
+
+#ifndef __unused
+#define __unused __attribute__((unused))
+#endif
@@ -0,0 +1,14 @@
+// -*- C++ -*-
+
+#pragma once
+
+#include <circle/types.h>
+#include <circle/synchronize.h>
+
+typedef void TKeyStatusHandlerRaw(unsigned char ucModifiers, const unsigned char RawKeys[6]);
+
+class CUSBKeyboardDevice
+{
+public:
+  void RegisterKeyStatusHandlerRaw(TKeyStatusHandlerRaw* pKeyStatusHandlerRaw) {}
+};
@@ -14,15 +14,14 @@ PiVT* PiVT::_this = nullptr;
 
 PiVT::PiVT()
   : Logging("PiVT"),
-    _serial_device(&_interrupt),
+    _serial_port(&_interrupt),
     _timer(&_interrupt),
-    _logger(LogDebug, &_timer),
+    _logger(PIVT_LOG_LEVEL, &_timer),
     _usb_hci(&_interrupt, &_timer),
     _emmc(&_interrupt, &_timer, &_act_led)
 {
   _interrupt.Initialize();
-  _serial_device.Initialize(38400);
-  _serial_device.SetOptions(0);
+  _serial_port.initialize(38400);
 
   CDevice* logTarget = _device_name_service.GetDevice(_options.GetLogDevice(), false);
   if (logTarget == nullptr) {
@@ -47,7 +46,7 @@ PiVT::PiVT()
 
   CGlueStdioInit(_file_system);
 
-  _terminal = new Terminal(&_serial_device);
+  _terminal = new Terminal(&_serial_port);
 
   log(LogNotice, "PiVT starting");
 
@@ -9,7 +9,6 @@
 #include <circle/koptions.h>
 #include <circle/devicenameservice.h>
 #include <circle/screen.h>
-#include <circle/serial.h>
 #include <circle/exceptionhandler.h>
 #include <circle/interrupt.h>
 #include <circle/timer.h>
@@ -17,6 +16,7 @@
 #include <circle/types.h>
 
 #include "Logging.h"
+#include "SerialPort.h"
 #include "Terminal.h"
 
 class PiVT
@@ -42,7 +42,7 @@ private:
   CNullDevice _null_device;
   CExceptionHandler _exception_handler;
   CInterruptSystem _interrupt;
-  CSerialDevice _serial_device;
+  SerialPort _serial_port;
   CTimer _timer;
   CLogger _logger;
   CUSBHCIDevice _usb_hci;
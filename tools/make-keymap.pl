@@ -1,29 +1,58 @@
 #!/usr/bin/perl -w
 
+# Generates the initializer of Keyboard::_keymap from keymap.txt.  The
+# table has one entry for each of the 256 USB key codes.  Byte
+# sequences are written as hex escapes so that they can contain any
+# byte, including NUL.
+
 use strict;
 
+sub sequence {
+    my $bytes = shift;
+    my $escaped = join('', map { sprintf('\\x%02x', ord($_)) } split(//, $bytes));
+    return sprintf('{ Send, %d, "%s" }', length($bytes), $escaped);
+}
+
 sub parse_spec {
     my $input = shift;
+    $input = '' unless defined($input);
     $input =~ s/^\s*(.*?)\s*$/$1/;
     if ($input =~ /^$/) {
-        return "&dead_key";
+        return '{ NoAction, 0, "" }';
     } elsif ($input =~ /^CSI (.*)/) {
-        return "new String(\"\\x1b[$1\")";
-    } elsif ($input =~ /^(".*")$/) {
-        return "new String($1)";
-    } elsif ($input =~ /^(0x..)$/) {
-        return "new Char($1)";
+        return sequence("\x1b[$1");
+    } elsif ($input =~ /^SS3 (.*)/) {
+        return sequence("\x1bO$1");
+    } elsif ($input =~ /^"(.*)"$/) {
+        my $string = $1;
+        $string =~ s/\\(.)/$1/g;
+        return sequence($string);
+    } elsif ($input =~ /^0x(..)$/) {
+        return sequence(chr(hex($1)));
     } else {
-        return "new $1()";
+        return "{ $input, 0, \"\" }";
     }
 }
 
+my @entries;
 while (<>) {
     next if (/^#/);
     chomp;
-    my ($code, $solo, $shift, $control, $name) = split(/\t/);
-    if ($solo or $shift or $control) {
-        printf '_map[%s] = new KeyDefinition("%s", %s, %s, %s);', $code, $name, parse_spec($solo), parse_spec($shift), parse_spec($control);
-        print "\n";
+    my ($code, $solo, $shift, $control, $application, $name) = split(/\t/);
+    my $mode = 'NoApplicationMode';
+    if ($application) {
+        $mode = ($name =~ /^KEYPAD_/) ? 'ApplicationKeypad' : 'ApplicationCursorKeys';
     }
+    $entries[hex($code)] = sprintf('{ "%s", %s, %s, %s, %s, %s }',
+                                   $name,
+                                   parse_spec($solo),
+                                   parse_spec($shift),
+                                   parse_spec($control),
+                                   parse_spec($application),
+                                   $mode);
+}
+
+for my $code (0 .. 255) {
+    my $entry = $entries[$code] || '{ "", { NoAction, 0, "" }, { NoAction, 0, "" }, { NoAction, 0, "" }, { NoAction, 0, "" }, NoApplicationMode }';
+    printf "/* 0x%02x */ %s,\n", $code, $entry;
 }
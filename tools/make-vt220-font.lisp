@@ -23,21 +23,26 @@
                     (otherwise i)))
                (src-x (+ 1 (* (floor i 16) 10)))
                (src-y (+ 2 (* (mod i 16) 12))))
+          ;; Each row of a glyph is written as a 16 bit word, with the
+          ;; leftmost pixel in the lowest bit.
           (dotimes (y 10)
             (labels ((pixel-at-p (cx cy)
                        (zerop (get-pixel (+ src-x cx) (+ src-y cy))))
-                     (write-pixel (setp)
-                       (format t "~A " (if setp "*" "."))
-                       (format output "0x~2,'0X, " (if setp 255 0)))
+                     (row-pixel-p (x)
+                       (if (< x 8)
+                           (or (pixel-at-p x y)
+                               (and (plusp x)
+                                    (pixel-at-p (1- x) y)))
+                           (pixel-at-p 7 y)))
                      (make-row ()
-                       (format t "[")
-                       (dotimes (x 8)
-                         (write-pixel (or (pixel-at-p x y)
-                                          (and (plusp x)
-                                               (pixel-at-p (1- x) y)))))
-                       (dotimes (x 2)
-                         (write-pixel (pixel-at-p 7 y)))
-                       (terpri output)
-                       (format t "]~%")))
+                       (let ((row 0))
+                         (format t "[")
+                         (dotimes (x 10)
+                           (let ((setp (row-pixel-p x)))
+                             (format t "~A " (if setp "*" "."))
+                             (when setp
+                               (setf row (logior row (ash 1 x))))))
+                         (format output "0x~4,'0X, ~%" row)
+                         (format t "]~%"))))
               (make-row)
               (make-row))))))))